@@ -1,43 +1,278 @@
+#define _POSIX_C_SOURCE 200809L
 #include "pickle.h"
 #include "mod.h"
+#include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/* One statistic per line so reports from different runs can be diffed */
+static int heapReport(heap_t *h, pickle_buffer_t *b) {
+	char line[512] = { 0 };
+	const struct heap_stat { const char *name; long value; } stats[] = {
+		{ "allocations",   h->allocs   },
+		{ "frees",         h->frees    },
+		{ "reallocations", h->reallocs },
+		{ "total",         h->total    },
+		{ "live",          h->live     },
+		{ "peak",          h->peak     },
+		{ "limit",         h->limit    },
+		{ "pages",         h->slab.page_count },
+	};
+	for (size_t j = 0; j < NELEMS(stats); j++) {
+		const int l = snprintf(line, sizeof line, "%s %ld\n", stats[j].name, stats[j].value);
+		if (l < 0 || pickle_buffer_add(b, line, l) != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
+	for (size_t j = 0; j < NELEMS(h->histogram); j++) {
+		if (!h->histogram[j])
+			continue;
+		const int l = snprintf(line, sizeof line, "size %lu %ld\n", 1ul << j, h->histogram[j]);
+		if (l < 0 || pickle_buffer_add(b, line, l) != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
+	for (size_t j = 0; j < h->accounts_length; j++) {
+		const heap_account_t *a = &h->accounts[j];
+		const int l = snprintf(line, sizeof line, "%s %s allocations %ld bytes %ld live %ld limit %ld\n",
+				a->parent || !j ? "command" : "module", a->name ? a->name : "-",
+				a->allocs, a->bytes, a->live, a->limit);
+		if (l < 0 || pickle_buffer_add(b, line, MIN((size_t)l, sizeof line - 1)) != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+static int commandHeapReport(pickle_t *i, int argc, char **argv, heap_t *h) {
+	if (argc != 2 + !strcmp(argv[1], "dump"))
+		return error(i, "Invalid subcommand %s", argv[1]);
+	pickle_buffer_t b = { .i = i };
+	if (heapReport(h, &b) != PICKLE_OK)
+		return error(i, "Out Of Memory");
+	int r = PICKLE_OK;
+	if (argc == 3) {
+		errno = 0;
+		FILE *f = fopen(argv[2], "wb");
+		if (!f) {
+			r = error(i, "Could not open file '%s' for writing: %s", argv[2], strerror(errno));
+		} else {
+			const int w = b.buf && fputs(b.buf, f) < 0;
+			if (fclose(f) < 0 || w)
+				r = error(i, "Could not write to file '%s'", argv[2]);
+		}
+	} else {
+		r = ok(i, "%s", b.buf ? b.buf : "");
+	}
+	return pickle_buffer_free(&b) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+static int commandHeapLimit(pickle_t *i, int argc, char **argv, heap_t *h) {
+	long *limit = &h->limit;
+	if (argc >= 4 && !strcmp(argv[2], "module")) {
+		limit = NULL;
+		for (size_t j = 1; j < h->accounts_length && !limit; j++)
+			if (!h->accounts[j].parent && !strcmp(h->accounts[j].name, argv[3]))
+				limit = &h->accounts[j].limit;
+		if (!limit)
+			return error(i, "Invalid module %s", argv[3]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc == 2)
+		return ok(i, "%ld", *limit);
+	if (argc != 3)
+		return error(i, "Invalid subcommand %s: expected ?module name? ?bytes?", argv[1]);
+	long l = 0;
+	if (sscanf(argv[2], "%ld", &l) != 1 || l < 0)
+		return error(i, "Invalid number %s", argv[2]);
+	*limit = l;
+	return ok(i, "%ld", l);
+}
 
 static int commandHeap(pickle_t *i, int argc, char **argv, void *pd) {
 	heap_t *h = pd;
+	if (argc >= 2 && !strcmp(argv[1], "limit"))  return commandHeapLimit(i, argc, argv, h);
+	if (argc >= 2 && !strcmp(argv[1], "report")) return commandHeapReport(i, argc, argv, h);
+	if (argc >= 2 && !strcmp(argv[1], "dump"))   return commandHeapReport(i, argc, argv, h);
 	if (argc != 2)
 		return error(i, "Invalid command %s", argv[0]);
 	if (!strcmp(argv[1], "frees"))         return ok(i, "%ld", h->frees);
 	if (!strcmp(argv[1], "allocations"))   return ok(i, "%ld", h->allocs);
 	if (!strcmp(argv[1], "total"))         return ok(i, "%ld", h->total);
 	if (!strcmp(argv[1], "reallocations")) return ok(i, "%ld", h->reallocs);
+	if (!strcmp(argv[1], "pages"))         return ok(i, "%ld", h->slab.page_count);
+	if (!strcmp(argv[1], "live"))          return ok(i, "%ld", h->live);
+	if (!strcmp(argv[1], "peak"))          return ok(i, "%ld", h->peak);
 	return error(i, "Invalid command %s", argv[0]);
 }
 
-static int commandSource(pickle_t *i, int argc, char **argv, void *pd) {
-	if (argc != 1 && argc != 2)
-		return error(i, "Invalid command %s", argv[0]);
-	errno = 0;
-	FILE *file = argc == 1 ? pd : fopen(argv[1], "rb");
-	if (!file)
-		return error(i, "Could not open file '%s' for reading: %s", argv[1], strerror(errno));
-	char *program = pickle_slurp(i, file, NULL, NULL);
-	if (file != pd)
-		fclose(file);
+/* Scripts that are sourced repeatedly are kept in memory, keyed by path and
+ * validated against the device, inode, size, and modification and status
+ * change times of the file, so that a file replaced by a rename is noticed
+ * even if it has the same size and modification time. Entries
+ * in use by a 'source' that is still being evaluated are never evicted. */
+
+#define SOURCE_CACHE_ENTRIES (16)
+#define SOURCE_CACHE_MAX     (16ul * 1024ul * 1024ul) /* do not cache files larger than this */
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime, ctime;
+	long mtime_ns, ctime_ns;
+} source_stamp_t;
+
+typedef struct {
+	char *path, *program;
+	size_t length;
+	source_stamp_t stamp;
+	unsigned long used, busy;
+} source_entry_t;
+
+typedef struct {
+	source_entry_t entries[SOURCE_CACHE_ENTRIES];
+	unsigned long tick, hits, misses;
+} source_cache_t;
+
+static int sourceEntryFree(pickle_t *i, source_entry_t *e) {
+	assert(e);
+	assert(!e->busy);
+	const int r1 = pickle_free(i, e->path);
+	const int r2 = pickle_free(i, e->program);
+	memset(e, 0, sizeof *e);
+	return r1 == PICKLE_OK && r2 == PICKLE_OK ? PICKLE_OK : PICKLE_ERROR;
+}
+
+static int sourceCacheFree(pickle_t *i, source_cache_t *c) {
+	assert(c);
+	int r = PICKLE_OK;
+	for (size_t j = 0; j < SOURCE_CACHE_ENTRIES; j++)
+		if (sourceEntryFree(i, &c->entries[j]) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	return r;
+}
+
+static source_stamp_t sourceStamp(const struct stat *st) {
+	assert(st);
+	source_stamp_t s = {
+		.dev   = st->st_dev,
+		.ino   = st->st_ino,
+		.size  = st->st_size,
+		.mtime = st->st_mtime,
+		.ctime = st->st_ctime,
+	};
+#ifndef _WIN32
+	s.mtime_ns = st->st_mtim.tv_nsec;
+	s.ctime_ns = st->st_ctim.tv_nsec;
+#endif
+	return s;
+}
+
+static int sourceFresh(const source_entry_t *e, const struct stat *st) {
+	assert(e);
+	assert(st);
+	const source_stamp_t s = sourceStamp(st);
+	return e->stamp.dev == s.dev && e->stamp.ino == s.ino && e->stamp.size == s.size
+		&& e->stamp.mtime == s.mtime && e->stamp.mtime_ns == s.mtime_ns
+		&& e->stamp.ctime == s.ctime && e->stamp.ctime_ns == s.ctime_ns;
+}
+
+static int evalProgram(pickle_t *i, char *program) {
 	if (!program)
 		return error(i, "Out Of Memory");
 	const int r = pickle_eval(i, program);
 	return pickle_free(i, program) == PICKLE_OK ? r : PICKLE_ERROR;
 }
 
-static int evalFile(pickle_t *i, char *file) {
+static int sourceFile(pickle_t *i, source_cache_t *c, const char *path, int cache) {
+	assert(c);
+	assert(path);
+	struct stat st;
+	source_entry_t *e = NULL, *victim = NULL;
+	if (cache && stat(path, &st) == 0) {
+		for (size_t j = 0; j < SOURCE_CACHE_ENTRIES && !e; j++) {
+			source_entry_t *x = &c->entries[j];
+			if (x->path && !strcmp(x->path, path))
+				e = x;
+			else if (!x->busy && (!victim || x->used < victim->used))
+				victim = x;
+		}
+		if (e && sourceFresh(e, &st)) {
+			c->hits++;
+			e->used = ++c->tick;
+			e->busy++;
+			const int r = pickle_eval(i, e->program);
+			e->busy--;
+			return r;
+		}
+		if (e) /* stale, replace it unless it is still being evaluated */
+			victim = e->busy ? NULL : e;
+	}
+	c->misses += cache;
+	errno = 0;
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return error(i, "Could not open file '%s' for reading: %s", path, strerror(errno));
+	const int stated = fstat(fileno(file), &st) == 0;
+	size_t length = 0;
+	char *program = pickle_slurp(i, file, &length, NULL);
+	fclose(file);
+	if (!cache || !program || !victim || !stated || length > SOURCE_CACHE_MAX || (off_t)length != st.st_size)
+		return evalProgram(i, program);
+	if (sourceEntryFree(i, victim) != PICKLE_OK) {
+		(void)pickle_free(i, program);
+		return PICKLE_ERROR;
+	}
+	const size_t pl = strlen(path);
+	if (!(victim->path = pickle_allocate(i, pl + 1)))
+		return evalProgram(i, program);
+	memcpy(victim->path, path, pl + 1);
+	victim->program  = program;
+	victim->length   = length;
+	victim->stamp    = sourceStamp(&st);
+	victim->used     = ++c->tick;
+	victim->busy++;
+	const int r = pickle_eval(i, program);
+	victim->busy--;
+	return r;
+}
+
+static int commandSource(pickle_t *i, int argc, char **argv, void *pd) {
+	source_cache_t *c = pd;
+	if (argc == 2 && !strcmp(argv[1], "-stats")) {
+		size_t entries = 0, bytes = 0;
+		for (size_t j = 0; j < SOURCE_CACHE_ENTRIES; j++) {
+			entries += !!(c->entries[j].path);
+			bytes += c->entries[j].length;
+		}
+		return ok(i, "{hits %lu} {misses %lu} {entries %lu} {bytes %lu}",
+				c->hits, c->misses, (unsigned long)entries, (unsigned long)bytes);
+	}
+	if (argc == 3 && !strcmp(argv[1], "-nocache"))
+		return sourceFile(i, c, argv[2], 0);
+	if (argc != 2)
+		return error(i, "Invalid command %s: expected ?-nocache? file *OR* -stats", argv[0]);
+	return sourceFile(i, c, argv[1], 1);
+}
+
+static int evalFile(pickle_t *i, source_cache_t *c, char *file) {
 	const int r = file ?
-		commandSource(i, 2, (char*[2]){ "source", file }, NULL):
-		commandSource(i, 1, (char*[1]){ "source",      }, stdin);
+		sourceFile(i, c, file, 1):
+		evalProgram(i, pickle_slurp(i, stdin, NULL, NULL));
 	if (r != PICKLE_OK) {
 		const char *f = NULL;
 		if (pickle_result_get(i, &f) != PICKLE_OK)
@@ -48,31 +283,288 @@ static int evalFile(pickle_t *i, char *file) {
 	return r;
 }
 
+/* Evaluate each script named on the command line, or standard input if
+ * there are none, returning the result of the last one */
+static int run(pickle_t *i, source_cache_t *cache, int argc, char **argv) {
+	if (pickle_var_set_args(i, "argv", argc, argv) != PICKLE_OK)
+		return PICKLE_ERROR;
+	int r = 0;
+	for (int j = 1; j < argc; j++) {
+		r = evalFile(i, cache, argv[j]);
+		if (r < 0 || r == PICKLE_BREAK)
+			break;
+	}
+	if (argc == 1)
+		r = evalFile(i, cache, NULL);
+	return r;
+}
+
+#ifndef _WIN32
+/* 'pickle -serve socket' sets up an interpreter once and then serves
+ * requests on a Unix domain socket, forking a copy of that interpreter
+ * for each one so every script starts from the same fresh state without
+ * paying for interpreter creation and module registration, or for the
+ * self tests if PICKLE_TESTS asked for them. Modules are still initialized
+ * on first use, in each copy, as some of them hold descriptors (the event
+ * loop) or terminal state (the screen) that must not be shared between
+ * scripts. 'pickle -client socket script...' hands its standard file
+ * descriptors, working directory and arguments to the server, so output
+ * goes straight to the client's own descriptors, and exits with the
+ * status of the script. The socket is only accessible to the user that
+ * started the server, and a socket a running server is listening on is
+ * never replaced.
+ *
+ * A request is a 32-bit length, sent along with the three descriptors,
+ * followed by that many bytes of NUL terminated strings: the working
+ * directory then the arguments. The reply is the exit status as an int. */
+
+#define SERVE_REQUEST_MAX (256ul * 1024ul)
+
+static int serveAddress(struct sockaddr_un *a, const char *path) {
+	assert(a);
+	assert(path);
+	const size_t l = strlen(path);
+	memset(a, 0, sizeof *a);
+	a->sun_family = AF_UNIX;
+	if (l >= sizeof a->sun_path)
+		return -1;
+	memcpy(a->sun_path, path, l + 1);
+	return 0;
+}
+
+/* SOCK_CLOEXEC and MSG_CMSG_CLOEXEC are not portable */
+static int cloexec(int fd) {
+	const int flags = fcntl(fd, F_GETFD);
+	return flags < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0 ? -1 : 0;
+}
+
+static int readAll(int fd, void *buf, size_t length) {
+	for (size_t done = 0; done < length;) {
+		const ssize_t n = read(fd, (char*)buf + done, length - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int writeAll(int fd, const void *buf, size_t length) {
+	for (size_t done = 0; done < length;) {
+		const ssize_t n = write(fd, (const char*)buf + done, length - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int client(const char *path, int argc, char **argv) {
+	assert(path);
+	char cwd[PATH_MAX] = { 0 };
+	if (!getcwd(cwd, sizeof cwd)) {
+		(void)fprintf(stderr, "getcwd failed: %s\n", strerror(errno));
+		return 1;
+	}
+	size_t length = strlen(cwd) + 1;
+	for (int j = 0; j < argc; j++)
+		length += strlen(argv[j]) + 1;
+	char *request = malloc(length);
+	if (!request || length > SERVE_REQUEST_MAX) {
+		(void)fprintf(stderr, "request too large\n");
+		free(request);
+		return 1;
+	}
+	char *p = request;
+	p = stpcpy(p, cwd) + 1;
+	for (int j = 0; j < argc; j++)
+		p = stpcpy(p, argv[j]) + 1;
+	struct sockaddr_un a;
+	int s = socket(AF_UNIX, SOCK_STREAM, 0), status = 1;
+	if (s < 0 || cloexec(s) < 0 || serveAddress(&a, path) < 0 || connect(s, (struct sockaddr*)&a, sizeof a) < 0) {
+		(void)fprintf(stderr, "could not connect to '%s': %s\n", path, strerror(errno));
+		goto done;
+	}
+	uint32_t header = length;
+	int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char control[CMSG_SPACE(sizeof fds)];
+	memset(control, 0, sizeof control);
+	struct iovec iov = { .iov_base = &header, .iov_len = sizeof header };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control };
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(c), fds, sizeof fds);
+	if (fflush(NULL) < 0 || sendmsg(s, &msg, 0) != (ssize_t)sizeof header || writeAll(s, request, length) < 0) {
+		(void)fprintf(stderr, "could not send request: %s\n", strerror(errno));
+		goto done;
+	}
+	if (readAll(s, &status, sizeof status) < 0) {
+		(void)fprintf(stderr, "no reply from server\n");
+		status = 1;
+	}
+done:
+	if (s >= 0)
+		(void)close(s);
+	free(request);
+	return status;
+}
+
+/* Runs in a child of the server, reads one request and then forks again
+ * to run it so the exit status can be reported even if the script calls
+ * 'exit' or crashes. */
+static int serveRequest(int conn, pickle_t *i, source_cache_t *cache) {
+	uint32_t length = 0;
+	int fds[3] = { -1, -1, -1 };
+	char control[CMSG_SPACE(sizeof fds)];
+	struct iovec iov = { .iov_base = &length, .iov_len = sizeof length };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control };
+	if (recvmsg(conn, &msg, 0) != (ssize_t)sizeof length)
+		return 1;
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(sizeof fds))
+		return 1;
+	memcpy(fds, CMSG_DATA(c), sizeof fds);
+	for (int j = 0; j < 3; j++) /* 'dup2' clears it on the copies the script gets */
+		if (cloexec(fds[j]) < 0)
+			return 1;
+	char *request = length && length <= SERVE_REQUEST_MAX ? malloc(length) : NULL;
+	if (!request || readAll(conn, request, length) < 0 || request[length - 1])
+		return 1;
+	int argc = -1; /* the first string is the working directory */
+	for (uint32_t j = 0; j < length; j++)
+		argc += !request[j];
+	char **argv = calloc(argc + 1, sizeof *argv);
+	if (!argv || argc < 1)
+		return 1;
+	char *cwd = request, *p = request + strlen(request) + 1;
+	for (int j = 0; j < argc; j++, p += strlen(p) + 1)
+		argv[j] = p;
+	const pid_t pid = fork();
+	if (pid < 0)
+		return 1;
+	if (pid == 0) {
+		for (int j = 0; j < 3; j++)
+			if (dup2(fds[j], j) < 0)
+				_exit(1);
+		(void)close(conn);
+		if (chdir(cwd) < 0) {
+			(void)fprintf(stderr, "chdir '%s' failed: %s\n", cwd, strerror(errno));
+			_exit(1);
+		}
+		const int r = run(i, cache, argc, argv);
+		exit(r < 0);
+	}
+	for (int j = 0; j < 3; j++)
+		(void)close(fds[j]);
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return 1;
+	status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	return writeAll(conn, &status, sizeof status) < 0;
+}
+
+static int serve(const char *path, pickle_t *i, source_cache_t *cache) {
+	assert(path);
+	struct sockaddr_un a;
+	struct stat st;
+	if (serveAddress(&a, path) < 0) {
+		(void)fprintf(stderr, "socket path too long '%s'\n", path);
+		return PICKLE_ERROR;
+	}
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		const int c = socket(AF_UNIX, SOCK_STREAM, 0);
+		const int live = c >= 0 && connect(c, (struct sockaddr*)&a, sizeof a) == 0;
+		if (c >= 0)
+			(void)close(c);
+		if (live) {
+			(void)fprintf(stderr, "a server is already running on '%s'\n", path);
+			return PICKLE_ERROR;
+		}
+		(void)unlink(path); /* left over from a previous server */
+	}
+	/* anyone who can connect can run scripts as us, so only we may */
+	const mode_t mask = umask(0177);
+	const int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	const int bound = s >= 0 && cloexec(s) == 0 && bind(s, (struct sockaddr*)&a, sizeof a) == 0;
+	(void)umask(mask);
+	if (!bound || listen(s, SOMAXCONN) < 0) {
+		(void)fprintf(stderr, "could not serve on '%s': %s\n", path, strerror(errno));
+		if (s >= 0)
+			(void)close(s);
+		return PICKLE_ERROR;
+	}
+	(void)signal(SIGCHLD, SIG_IGN); /* children are reaped automatically */
+	for (;;) {
+		const int conn = accept(s, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		(void)fflush(NULL); /* or the children would write it out again */
+		const pid_t pid = fork();
+		if (pid == 0) {
+			(void)close(s);
+			(void)signal(SIGCHLD, SIG_DFL);
+			_exit(serveRequest(conn, i, cache));
+		}
+		(void)close(conn);
+	}
+	(void)fprintf(stderr, "accept failed: %s\n", strerror(errno));
+	(void)close(s);
+	return PICKLE_ERROR;
+}
+#endif
+
 int main(int argc, char **argv) {
 	heap_t h = { 0 };
+	source_cache_t cache = { .tick = 0 };
 	pickle_t *i = NULL;
 	pickle_mods_t *ms = NULL;
-	if (pickle_tests(pickle_mod_allocator, &h)   != PICKLE_OK) goto fail;
+	const int server = argc == 3 && !strcmp(argv[1], "-serve");
+#ifndef _WIN32
+	if (argc >= 3 && !strcmp(argv[1], "-client")) { /* the client never creates an interpreter */
+		const char *path = argv[2];
+		argv[2] = argv[0];
+		return client(path, argc - 2, argv + 2);
+	}
+#endif
+	const char *allocator = getenv("PICKLE_ALLOCATOR"); /* "slab" or "system" (default) */
+	h.slab.on = allocator && !strcmp(allocator, "slab");
+	const char *tests = getenv("PICKLE_TESTS"); /* self tests are opt in, they slow down start up */
+	if (tests && tests[0] && pickle_tests(pickle_mod_allocator, &h) != PICKLE_OK) goto fail;
 	if (pickle_new(&i, pickle_mod_allocator, &h) != PICKLE_OK) goto fail;
 	if ((ms = pickle_register_mods(i)) == NULL) goto fail;
-	if (pickle_var_set_args(i, "argv", argc, argv)  != PICKLE_OK) goto fail;
-	if (pickle_command_register(i, "source", commandSource, NULL)   != PICKLE_OK) goto fail;
+	if (pickle_command_register(i, "source", commandSource, &cache) != PICKLE_OK) goto fail;
 	if (pickle_command_register(i, "heap",   commandHeap,   &h)   != PICKLE_OK) goto fail;
 	int r = 0;
-	for (int j = 1; j < argc; j++) {
-		r = evalFile(i, argv[j]);
-		if (r < 0)
-			goto fail;
-		if (r == PICKLE_BREAK)
-			break;
+	if (server) {
+#ifdef _WIN32
+		(void)fprintf(stderr, "-serve is not implemented\n");
+		r = PICKLE_ERROR;
+#else
+		r = serve(argv[2], i, &cache);
+#endif
+	} else {
+		r = run(i, &cache, argc, argv);
 	}
-	if (argc == 1)
-		r = evalFile(i, NULL);
 	pickle_destroy_mods(ms);
-	return !!pickle_delete(i) || r < 0;
+	const int c = sourceCacheFree(i, &cache);
+	const int d = pickle_delete(i);
+	pickle_mod_heap_destroy(&h);
+	return !!d || c != PICKLE_OK || r < 0;
 fail:
-	(void)pickle_destroy_mods(ms);
+	if (ms)
+		(void)pickle_destroy_mods(ms);
+	if (i)
+		(void)sourceCacheFree(i, &cache);
 	(void)pickle_delete(i);
+	pickle_mod_heap_destroy(&h);
 	return 1;
 }
-
@@ -0,0 +1,451 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mod.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <tmmintrin.h>
+#define BASE64_SSSE3 (1)
+#endif
+
+/* Base64 (RFC 4648, with the URL and file name safe alphabet as an option)
+ * and hexadecimal encoding and decoding. Strings cannot hold NUL bytes so
+ * decoding anything that contains one is an error, use '-file' to decode
+ * binary data straight to a file; files are processed in fixed size chunks
+ * whatever their size.
+ *
+ * Decoding skips white space, in hex as well as base64, and either can be
+ * split anywhere between chunks of a file.
+ *
+ * The base64 kernels use SSSE3, selected at run time so the build does
+ * not need any special flags, and the hex kernels SSE2. Both handle 16
+ * bytes at a time and hand anything they cannot, such as white space or
+ * padding, to the scalar code. */
+
+#define BASE64_CHUNK (48ul * 1024ul) /* a multiple of 3, 4 and 16 */
+#define BASE64_SPACE " \t\r\n"
+
+static const char standard[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char url[]      = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+enum { INVALID = 0x40, SPACE = 0x41, PAD = 0x42, };
+
+typedef struct {
+	const char *alphabet;
+	unsigned char decode[256];
+	int simd;
+} codec_t;
+
+typedef struct { /* decoder state carried between chunks */
+	unsigned long acc; /* pending sextets, or for hex a high nibble */
+	int n, padded;
+} decode_state_t;
+
+static void codecInit(codec_t *c, const char *alphabet) {
+	assert(c);
+	assert(alphabet);
+	c->alphabet = alphabet;
+	memset(c->decode, INVALID, sizeof c->decode);
+	for (int j = 0; j < 64; j++)
+		c->decode[(unsigned char)alphabet[j]] = j;
+	for (const char *sp = BASE64_SPACE; *sp; sp++)
+		c->decode[(unsigned char)*sp] = SPACE;
+	c->decode['='] = PAD;
+	c->simd = 0;
+#ifdef BASE64_SSSE3
+	c->simd = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+#ifdef BASE64_SSSE3
+/* Encode 12 bytes into 16 characters per step, reading 16 bytes at a time,
+ * see <http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html> */
+__attribute__((target("ssse3")))
+static size_t encodeSSSE3(const codec_t *c, const unsigned char *in, size_t length, char *out) {
+	const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, c->alphabet[62] - 62, c->alphabet[63] - 63, 'A', 0, 0);
+	size_t j = 0;
+	for (; length - j >= 16; j += 12, out += 16) {
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + j)), shuffle);
+		const __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+		const __m128i t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+		const __m128i indices = _mm_or_si128(t0, t1); /* 16 six bit values */
+		__m128i r = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+		_mm_storeu_si128((__m128i*)out, _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, r)));
+	}
+	return j;
+}
+
+__attribute__((target("ssse3")))
+static __m128i range(__m128i v, char lo, char hi) {
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+}
+
+/* Decode 16 characters into 12 bytes per step, stopping at the first block
+ * with anything but alphabet characters in it. 'out' must have room for
+ * four bytes past the end of the output. */
+__attribute__((target("ssse3")))
+static size_t decodeSSSE3(const codec_t *c, const char *in, size_t length, unsigned char *out) {
+	const __m128i c62 = _mm_set1_epi8(c->alphabet[62]), c63 = _mm_set1_epi8(c->alphabet[63]);
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t j = 0;
+	for (; length - j >= 16; j += 16, out += 12) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)(in + j));
+		const __m128i upper = range(v, 'A', 'Z'), lower = range(v, 'a', 'z'), digit = range(v, '0', '9');
+		const __m128i e62 = _mm_cmpeq_epi8(v, c62), e63 = _mm_cmpeq_epi8(v, c63);
+		const __m128i valid = _mm_or_si128(_mm_or_si128(_mm_or_si128(upper, lower), digit), _mm_or_si128(e62, e63));
+		if (_mm_movemask_epi8(valid) != 0xFFFF)
+			break;
+		__m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+		shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+		shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+		shift = _mm_or_si128(shift, _mm_and_si128(e62, _mm_set1_epi8(62 - c->alphabet[62])));
+		shift = _mm_or_si128(shift, _mm_and_si128(e63, _mm_set1_epi8(63 - c->alphabet[63])));
+		const __m128i sextets = _mm_add_epi8(v, shift);
+		const __m128i pairs = _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140)); /* 12 bit pairs */
+		const __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000)); /* 24 bit groups */
+		_mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(words, pack));
+	}
+	return j;
+}
+#endif
+
+/* Encode, with padding, returning the number of characters written */
+static size_t b64Encode(const codec_t *c, const unsigned char *in, size_t length, char *out) {
+	assert(c);
+	size_t j = 0, o = 0;
+#ifdef BASE64_SSSE3
+	if (c->simd) {
+		j = encodeSSSE3(c, in, length, out);
+		o = (j / 3) * 4;
+	}
+#endif
+	for (; length - j >= 3; j += 3, o += 4) {
+		const unsigned long v = ((unsigned long)in[j] << 16) | ((unsigned long)in[j + 1] << 8) | in[j + 2];
+		out[o]     = c->alphabet[(v >> 18) & 0x3F];
+		out[o + 1] = c->alphabet[(v >> 12) & 0x3F];
+		out[o + 2] = c->alphabet[(v >>  6) & 0x3F];
+		out[o + 3] = c->alphabet[v & 0x3F];
+	}
+	if (length - j) {
+		const unsigned long v = ((unsigned long)in[j] << 16) | (length - j == 2 ? (unsigned long)in[j + 1] << 8 : 0);
+		out[o]     = c->alphabet[(v >> 18) & 0x3F];
+		out[o + 1] = c->alphabet[(v >> 12) & 0x3F];
+		out[o + 2] = length - j == 2 ? c->alphabet[(v >> 6) & 0x3F] : '=';
+		out[o + 3] = '=';
+		o += 4;
+	}
+	return o;
+}
+
+/* Decode some of the input, which may be split anywhere between calls,
+ * returning the number of bytes written or -1 if it is invalid. White
+ * space is skipped and padding is optional. */
+static long b64Decode(const codec_t *c, decode_state_t *st, const char *in, size_t length, unsigned char *out) {
+	assert(c);
+	assert(st);
+	size_t j = 0, o = 0;
+	while (j < length) {
+#ifdef BASE64_SSSE3
+		if (c->simd && !st->n && !st->padded && length - j >= 16) {
+			const size_t n = decodeSSSE3(c, in + j, length - j, out + o);
+			j += n;
+			o += (n / 4) * 3;
+			if (j >= length)
+				break;
+		}
+#endif
+		const unsigned char d = c->decode[(unsigned char)in[j++]];
+		if (d == SPACE)
+			continue;
+		if (d == INVALID || (st->padded && d != PAD))
+			return -1;
+		if (d == PAD) {
+			if (st->padded)
+				continue;
+			if (st->n < 2)
+				return -1;
+			st->padded = 1;
+			st->acc <<= 6 * (4 - st->n);
+			out[o++] = st->acc >> 16;
+			if (st->n == 3)
+				out[o++] = st->acc >> 8;
+			st->n = 0;
+			st->acc = 0;
+			continue;
+		}
+		st->acc = (st->acc << 6) | d;
+		if (++st->n == 4) {
+			out[o++] = st->acc >> 16;
+			out[o++] = st->acc >> 8;
+			out[o++] = st->acc;
+			st->n = 0;
+			st->acc = 0;
+		}
+	}
+	return o;
+}
+
+/* Write out anything left over from unpadded input */
+static long b64Finish(decode_state_t *st, unsigned char *out) {
+	assert(st);
+	if (st->n == 1)
+		return -1;
+	if (st->n == 0)
+		return 0;
+	st->acc <<= 6 * (4 - st->n);
+	out[0] = st->acc >> 16;
+	out[1] = st->acc >> 8;
+	const long r = st->n - 1;
+	st->n = 0;
+	return r;
+}
+
+static size_t hexEncode(const unsigned char *in, size_t length, char *out) {
+	static const char digits[] = "0123456789abcdef";
+	size_t j = 0;
+#ifdef __SSE2__
+	for (; length - j >= 16; j += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)(in + j)), mask = _mm_set1_epi8(0x0F);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask), lo = _mm_and_si128(v, mask);
+		const __m128i a = _mm_unpacklo_epi8(hi, lo), b = _mm_unpackhi_epi8(hi, lo);
+		const __m128i nine = _mm_set1_epi8(9), letter = _mm_set1_epi8('a' - '0' - 10), zero = _mm_set1_epi8('0');
+		const __m128i x = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), letter));
+		const __m128i y = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), letter));
+		_mm_storeu_si128((__m128i*)(out + (2 * j)), x);
+		_mm_storeu_si128((__m128i*)(out + (2 * j) + 16), y);
+	}
+#endif
+	for (; j < length; j++) {
+		out[2 * j]       = digits[in[j] >> 4];
+		out[(2 * j) + 1] = digits[in[j] & 0xF];
+	}
+	return 2 * length;
+}
+
+static int nibble(const char ch) {
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	if (ch >= 'a' && ch <= 'f')
+		return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 10;
+	return -1;
+}
+
+#ifdef __SSE2__
+/* Decode 32 hex digits into 16 bytes per step, stopping at the first block
+ * with anything else in it */
+static size_t hexDecodeSSE2(const char *in, size_t length, unsigned char *out) {
+	size_t j = 0;
+	for (; length - j >= 32; j += 32) {
+		__m128i n[2];
+		int k = 0;
+		for (; k < 2; k++) {
+			const __m128i v = _mm_loadu_si128((const __m128i*)(in + j + (16 * k)));
+			const __m128i l = _mm_or_si128(v, _mm_set1_epi8(0x20)); /* lower case letters */
+			const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+			const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), l));
+			if (_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xFFFF)
+				break;
+			n[k] = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+					_mm_and_si128(alpha, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+		}
+		if (k < 2)
+			break;
+		for (k = 0; k < 2; k++) /* high nibble is the low byte of each pair */
+			n[k] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n[k], _mm_set1_epi16(0x00FF)), 4), _mm_srli_epi16(n[k], 8));
+		_mm_storeu_si128((__m128i*)(out + (j / 2)), _mm_packus_epi16(n[0], n[1]));
+	}
+	return j;
+}
+#endif
+
+/* Decode some hex digits, which may be split anywhere between calls,
+ * returning the number of bytes written or -1 if there is anything but
+ * digits and white space in the input */
+static long hexDecode(decode_state_t *st, const char *in, size_t length, unsigned char *out) {
+	assert(st);
+	size_t j = 0, o = 0;
+	while (j < length) {
+#ifdef __SSE2__
+		if (!st->n && length - j >= 32) {
+			const size_t n = hexDecodeSSE2(in + j, length - j, out + o);
+			j += n;
+			o += n / 2;
+			if (j >= length)
+				break;
+		}
+#endif
+		const char ch = in[j++];
+		if (ch && strchr(BASE64_SPACE, ch))
+			continue;
+		const int d = nibble(ch);
+		if (d < 0)
+			return -1;
+		if (!st->n) {
+			st->acc = d;
+			st->n = 1;
+			continue;
+		}
+		out[o++] = (st->acc << 4) | d;
+		st->n = 0;
+	}
+	return o;
+}
+
+/* Stream a file through an encoder or decoder in fixed size chunks, a
+ * NULL codec means hex */
+static int convertFile(pickle_t *i, const codec_t *c, int decode, const char *from, const char *to) {
+	assert(from);
+	assert(to);
+	errno = 0;
+	FILE *in = fopen(from, "rb"), *out = NULL;
+	if (!in)
+		return error(i, "Could not open file '%s' for reading: %s", from, strerror(errno));
+	if (!(out = fopen(to, "wb"))) {
+		fclose(in);
+		return error(i, "Could not open file '%s' for writing: %s", to, strerror(errno));
+	}
+	unsigned char *ibuf = pickle_allocate(i, BASE64_CHUNK);
+	unsigned char *obuf = pickle_allocate(i, (2 * BASE64_CHUNK) + 16);
+	decode_state_t st = { .acc = 0 };
+	int r = ibuf && obuf ? PICKLE_OK : error(i, "Out Of Memory");
+	while (r == PICKLE_OK) {
+		const size_t n = fread(ibuf, 1, BASE64_CHUNK, in);
+		const int last = n < BASE64_CHUNK;
+		if (last && ferror(in)) {
+			r = error(i, "Could not read from file '%s'", from);
+			break;
+		}
+		long w = 0;
+		if (!c) {
+			w = decode ? hexDecode(&st, (char*)ibuf, n, obuf) : (long)hexEncode(ibuf, n, (char*)obuf);
+			if (w >= 0 && decode && last && st.n) /* a lone digit at the end */
+				w = -1;
+		} else if (decode) {
+			w = b64Decode(c, &st, (char*)ibuf, n, obuf);
+			if (w >= 0 && last) {
+				const long f = b64Finish(&st, obuf + w);
+				w = f < 0 ? -1 : w + f;
+			}
+		} else {
+			w = b64Encode(c, ibuf, n, (char*)obuf);
+		}
+		if (w < 0)
+			r = error(i, "Invalid %s data in '%s'", c ? "base64" : "hex", from);
+		else if (fwrite(obuf, 1, w, out) != (size_t)w)
+			r = error(i, "Could not write to file '%s'", to);
+		if (last)
+			break;
+	}
+	(void)pickle_free(i, ibuf);
+	(void)pickle_free(i, obuf);
+	fclose(in);
+	if (fclose(out) < 0 && r == PICKLE_OK)
+		r = error(i, "Could not write to file '%s'", to);
+	return r == PICKLE_OK ? ok(i, "") : r;
+}
+
+static int convertString(pickle_t *i, const codec_t *c, int decode, const char *s) {
+	assert(s);
+	const size_t l = strlen(s);
+	const size_t size = (decode ? l : c ? ((l + 2) / 3) * 4 : 2 * l) + 16;
+	char *out = pickle_allocate(i, size);
+	if (!out)
+		return error(i, "Out Of Memory");
+	decode_state_t st = { .acc = 0 };
+	long w = 0;
+	if (!c) {
+		w = decode ? hexDecode(&st, s, l, (unsigned char*)out) : (long)hexEncode((const unsigned char*)s, l, out);
+		if (st.n) /* a lone digit at the end */
+			w = -1;
+	} else if (decode) {
+		w = b64Decode(c, &st, s, l, (unsigned char*)out);
+		const long f = w < 0 ? -1 : b64Finish(&st, (unsigned char*)out + w);
+		w = f < 0 ? -1 : w + f;
+	} else {
+		w = b64Encode(c, (const unsigned char*)s, l, out);
+	}
+	int r = PICKLE_OK;
+	if (w < 0)
+		r = error(i, "Invalid %s data", c ? "base64" : "hex");
+	else if (decode && memchr(out, '\0', w))
+		r = error(i, "Decoded data contains NUL bytes, use -file");
+	else
+		r = ok(i, "%.*s", (int)w, out);
+	return pickle_free(i, out) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+/* encode|decode ?-url? string *OR* encode|decode ?-url? -file from to */
+static int convert(pickle_t *i, int argc, char **argv, const codec_t *codecs) {
+	const int hex = !codecs;
+	if (argc < 3 || (strcmp(argv[1], "encode") && strcmp(argv[1], "decode")))
+		goto usage;
+	const int decode = argv[1][0] == 'd';
+	int j = 2, safe = 0, file = 0;
+	for (; j < argc - 1 && argv[j][0] == '-'; j++) {
+		if (!hex && !strcmp(argv[j], "-url"))
+			safe = 1;
+		else if (!strcmp(argv[j], "-file"))
+			file = 1;
+		else
+			goto usage;
+	}
+	if (argc - j != 1 + file)
+		goto usage;
+	const codec_t *c = hex ? NULL : &codecs[safe];
+	return file ?
+		convertFile(i, c, decode, argv[j], argv[j + 1]) :
+		convertString(i, c, decode, argv[j]);
+usage:
+	return error(i, "Invalid command %s: expected encode|decode %s?-file? string|from to", argv[0], hex ? "" : "?-url? ");
+}
+
+static int pickleCommandBase64(pickle_t *i, int argc, char **argv, void *pd) {
+	const codec_t *codecs = pickle_mod_tag_find(pd, "codecs");
+	assert(codecs);
+	return convert(i, argc, argv, codecs);
+}
+
+static int pickleCommandHex(pickle_t *i, int argc, char **argv, void *pd) {
+	UNUSED(pd);
+	return convert(i, argc, argv, NULL);
+}
+
+static int init(pickle_mod_t *m) {
+	assert(m);
+	codec_t *codecs = pickle_allocate(m->i, 2 * sizeof *codecs);
+	if (!codecs)
+		return PICKLE_ERROR;
+	codecInit(&codecs[0], standard);
+	codecInit(&codecs[1], url);
+	if (pickle_mod_tag_add(m, "codecs", codecs) != PICKLE_OK) {
+		(void)pickle_free(m->i, codecs);
+		return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	assert(m);
+	return pickle_free(m->i, tag);
+}
+
+int pickleModBase64Register(pickle_mod_t *m) {
+	assert(m);
+	pickle_command_t cmds[] = {
+		{ "base64", pickleCommandBase64, m },
+		{ "hex",    pickleCommandHex,    m },
+	};
+	m->init = init;
+	m->cleanup = cleanup;
+	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
+}
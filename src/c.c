@@ -1,13 +1,309 @@
+#define _POSIX_C_SOURCE 200809L
 #include "mod.h"
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+/* Channels are named streams that 'puts', 'gets', 'read', 'write' and
+ * friends operate on. The standard streams always exist, files opened with
+ * 'open' are module tags named after their handle and are closed when the
+ * module is cleaned up. 'setvbuf' may only be called before any other
+ * operation on a stream, so 'fconfigure' can only change the buffering of
+ * a channel that has not been used yet. The buffer installed on a standard
+ * stream is allocated with 'malloc' and never freed as the C library may
+ * write it out after the interpreter has gone, in 'exit', but a buffer it
+ * replaces is. */
+
+#define READ_CHUNK (64ul * 1024ul) /* first buffer for 'read -size', it doubles up to the size */
+
+enum { TAG_CHANNELS, TAG_CHANNEL, TAG_MAP, };
+
+typedef struct {
+	int type; /* TAG_CHANNEL, must come first */
+	char name[32];
+	FILE *file;
+	char *buffer;
+	size_t size; /* buffer size, zero for the C library default */
+	int mode;    /* _IOFBF, _IOLBF, _IONBF or -1 if not known yet */
+	int io;      /* set once the channel has been read, written or moved */
+} channel_t;
+
+typedef struct {
+	int type; /* TAG_CHANNELS, must come first */
+	channel_t std[3];
+} channels_t;
+
+static channel_t *channel(pickle_mod_t *m, const char *name) {
+	assert(m);
+	assert(name);
+	channels_t *cs = pickle_mod_tag_find(m, "channels");
+	assert(cs);
+	for (size_t j = 0; j < NELEMS(cs->std); j++)
+		if (!strcmp(cs->std[j].name, name))
+			return &cs->std[j];
+	channel_t *c = pickle_mod_tag_find(m, name);
+	return c && c->type == TAG_CHANNEL ? c : NULL;
+}
+
+/* A read only view of a whole file made with 'file map', the file is not
+ * copied into the interpreter, only the slices and lines asked for are. */
+typedef struct {
+	int type; /* TAG_MAP, must come first */
+	char name[32];
+	const char *data;
+	size_t size;
+} map_t;
+
+/* Channels for other modules, such as the event loop, the module is found
+ * by name as it might not be initialized yet, in which case only the
+ * standard channels exist. */
+FILE *pickle_mod_channel(pickle_mods_t *ms, const char *name) {
+	assert(ms);
+	assert(name);
+	pickle_mod_t *m = pickle_mod_find(ms, "c");
+	if (m && m->state == PICKLE_MOD_READY) {
+		channel_t *c = channel(m, name);
+		return c ? c->file : NULL;
+	}
+	return !strcmp(name, "stdin") ? stdin : !strcmp(name, "stdout") ? stdout : !strcmp(name, "stderr") ? stderr : NULL;
+}
+
+static int channelClose(channel_t *c) {
+	assert(c);
+	const int r = fclose(c->file) < 0 ? PICKLE_ERROR : PICKLE_OK;
+	free(c->buffer);
+	return r;
+}
+
+static int channelMode(channel_t *c) {
+	assert(c);
+	if (c->mode >= 0)
+		return c->mode;
+	if (c->file == stderr)
+		return _IONBF;
+#ifndef _WIN32
+	return isatty(fileno(c->file)) ? _IOLBF : _IOFBF;
+#else
+	return _IOFBF;
+#endif
+}
+
+#ifndef _WIN32
+/* Write a string and its newline with as few system calls as possible,
+ * after flushing anything already buffered so output stays in order. */
+static int channelWritev(channel_t *c, const char *s, const size_t l, const int newline) {
+	assert(c);
+	assert(s);
+	struct iovec v[2] = {
+		{ .iov_base = (void*)s,  .iov_len = l },
+		{ .iov_base = "\n",      .iov_len = 1 },
+	};
+	const size_t total = l + !!newline;
+	size_t done = 0;
+	if (fflush(c->file) < 0)
+		return PICKLE_ERROR;
+	while (done < total) {
+		struct iovec *iv = done < l ? &v[0] : &v[1];
+		const int n = newline && done < l ? 2 : 1;
+		if (done < l) {
+			v[0].iov_base = (void*)(s + done);
+			v[0].iov_len = l - done;
+		}
+		const ssize_t w = writev(fileno(c->file), iv, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return PICKLE_ERROR;
+		}
+		done += w;
+	}
+	return PICKLE_OK;
+}
+#endif
+
+/* Output that 'stdio' would write out straight away is written with a
+ * single 'writev' instead: anything on an unbuffered channel, a line on a
+ * line buffered channel, and on a fully buffered channel a string too large
+ * for the buffer, which 'fwrite' would write separately from its newline.
+ * Everything else is copied into the buffer. */
+static int channelWrite(channel_t *c, const char *s, const int newline) {
+	assert(c);
+	assert(s);
+	const size_t l = strlen(s);
+	c->io = 1;
+	if (c->mode < 0)
+		c->mode = channelMode(c);
+#ifndef _WIN32
+	const size_t size = c->size ? c->size : BUFSIZ;
+	if (c->mode == _IONBF || (c->mode == _IOLBF && newline) || (c->mode == _IOFBF && (l + 1) >= size))
+		return channelWritev(c, s, l, newline);
+#endif
+	if (fwrite(s, 1, l, c->file) != l)
+		return PICKLE_ERROR;
+	if (newline && putc('\n', c->file) == EOF)
+		return PICKLE_ERROR;
+	return PICKLE_OK;
+}
+
+static map_t *map(pickle_mod_t *m, const char *name) {
+	assert(m);
+	assert(name);
+	map_t *v = pickle_mod_tag_find(m, name);
+	return v && v->type == TAG_MAP ? v : NULL;
+}
+
+static int mapClose(map_t *v) {
+	assert(v);
+#ifndef _WIN32
+	if (v->size && munmap((void*)v->data, v->size) < 0)
+		return PICKLE_ERROR;
+#endif
+	return PICKLE_OK;
+}
+
+static int mapOpen(pickle_t *i, pickle_mod_t *m, const char *path) {
+	assert(m);
+	assert(path);
+#ifndef _WIN32
+	map_t *v = pickle_allocate(i, sizeof *v);
+	if (!v)
+		return error(i, "Out Of Memory");
+	v->type = TAG_MAP;
+	snprintf(v->name, sizeof v->name, "map%p", (void*)v);
+	errno = 0;
+	const int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		const int e = errno ? errno : EINVAL;
+		if (fd >= 0)
+			(void)close(fd);
+		(void)pickle_free(i, v);
+		return error(i, "map '%s' failed: %s", path, strerror(e));
+	}
+	v->size = st.st_size;
+	if (v->size) { /* an empty file cannot be mapped, but is a valid empty view */
+		void *d = mmap(NULL, v->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (d == MAP_FAILED) {
+			const int e = errno;
+			(void)close(fd);
+			(void)pickle_free(i, v);
+			return error(i, "map '%s' failed: %s", path, strerror(e));
+		}
+		v->data = d;
+	}
+	(void)close(fd); /* the mapping keeps the file alive */
+	if (pickle_mod_tag_add(m, v->name, v) != PICKLE_OK) {
+		(void)mapClose(v);
+		(void)pickle_free(i, v);
+		return error(i, "Out Of Memory");
+	}
+	return ok(i, "%s", v->name);
+#else
+	UNUSED(m);
+	return error(i, "map '%s' failed: not implemented", path);
+#endif
+}
+
+static int number(const char *s, size_t *n) {
+	assert(s);
+	assert(n);
+	long long v = 0;
+	if (sscanf(s, "%lld", &v) != 1 || v < 0)
+		return PICKLE_ERROR;
+	*n = v;
+	return PICKLE_OK;
+}
+
+static int mapSlice(pickle_t *i, map_t *v, const char *offset, const char *length) {
+	assert(v);
+	size_t o = 0, l = 0;
+	if (number(offset, &o) != PICKLE_OK || o > v->size)
+		return error(i, "Invalid offset %s", offset);
+	if (number(length, &l) != PICKLE_OK)
+		return error(i, "Invalid length %s", length);
+	l = MIN(l, v->size - o);
+	if (l > INT_MAX)
+		return error(i, "Slice too large %s", length);
+	return ok(i, "%.*s", (int)l, l ? &v->data[o] : "");
+}
+
+static int mapFind(pickle_t *i, map_t *v, const char *pattern, const char *start) {
+	assert(v);
+	assert(pattern);
+	size_t o = 0;
+	if (start && (number(start, &o) != PICKLE_OK || o > v->size))
+		return error(i, "Invalid offset %s", start);
+	const size_t pl = strlen(pattern);
+	if (!pl)
+		return ok(i, "%lld", (long long)o);
+	/* 'memchr' for the first byte is vectorised by the C library, only
+	 * candidates are compared in full */
+	for (const char *s = v->data + o, *end = v->data + v->size; (size_t)(end - s) >= pl; s++) {
+		if (!(s = memchr(s, pattern[0], (end - s) - pl + 1)))
+			break;
+		if (!memcmp(s, pattern, pl))
+			return ok(i, "%lld", (long long)(s - v->data));
+	}
+	return ok(i, "-1");
+}
+
+static int mapForEachLine(pickle_t *i, pickle_mod_t *m, const char *name, const char *var, const char *body) {
+	assert(m);
+	map_t *v = map(m, name);
+	assert(v);
+#ifdef POSIX_MADV_SEQUENTIAL
+	if (v->size)
+		(void)posix_madvise((void*)v->data, v->size, POSIX_MADV_SEQUENTIAL);
+#endif
+	char *line = NULL;
+	size_t size = 0;
+	int r = PICKLE_OK;
+	for (size_t o = 0; o < v->size;) {
+		const char *s = &v->data[o], *nl = memchr(s, '\n', v->size - o);
+		const size_t l = nl ? (size_t)(nl - s) : v->size - o;
+		o += l + !!nl;
+		if (l >= size) { /* one buffer for the loop, sized for the longest line */
+			(void)pickle_free(i, line);
+			size = MAX(l + 1, size * 2);
+			if (!(line = pickle_allocate(i, size))) {
+				r = error(i, "Out Of Memory");
+				break;
+			}
+		}
+		memcpy(line, s, l);
+		line[l] = '\0';
+		if ((r = pickle_var_set(i, var, line)) != PICKLE_OK)
+			break;
+		r = pickle_eval(i, body);
+		if (r == PICKLE_BREAK) {
+			r = PICKLE_OK;
+			break;
+		}
+		if (r != PICKLE_OK && r != PICKLE_CONTINUE)
+			break;
+		r = PICKLE_OK;
+		if (map(m, name) != v) { /* the body unmapped the view */
+			r = error(i, "Map %s closed during foreach-line", name);
+			break;
+		}
+	}
+	(void)pickle_free(i, line);
+	return r == PICKLE_OK ? ok(i, "") : r;
+}
 
 static int pickleCommandFile(pickle_t *i, int argc, char **argv, void *pd) {
-	UNUSED(pd);
+	pickle_mod_t *m = pd;
 	if (argc < 2)
 		return error(i, "Invalid command %s", argv[0]);
 	if (!strcmp("rename", argv[1])) {
@@ -26,14 +322,49 @@ static int pickleCommandFile(pickle_t *i, int argc, char **argv, void *pd) {
 				return error(i, "removed '%s' failed: %s", argv[2], strerror(errno));
 		return PICKLE_OK;
 	}
+	if (!strcmp("map", argv[1])) {
+		if (argc != 3)
+			return error(i, "Invalid command %s: expected file", argv[1]);
+		return mapOpen(i, m, argv[2]);
+	}
+	map_t *v = argc > 2 ? map(m, argv[2]) : NULL;
+	if (!strcmp("unmap", argv[1])) {
+		if (argc != 3 || !v)
+			return error(i, "Invalid command %s: expected map", argv[1]);
+		return pickle_mod_tag_remove(m, argv[2]) == PICKLE_OK ? PICKLE_OK : error(i, "unmap '%s' failed", argv[2]);
+	}
+	if (!strcmp("size", argv[1])) {
+		if (argc != 3 || !v)
+			return error(i, "Invalid command %s: expected map", argv[1]);
+		return ok(i, "%lld", (long long)v->size);
+	}
+	if (!strcmp("slice", argv[1])) {
+		if (argc != 5 || !v)
+			return error(i, "Invalid command %s: expected map offset length", argv[1]);
+		return mapSlice(i, v, argv[3], argv[4]);
+	}
+	if (!strcmp("find", argv[1])) {
+		if ((argc != 4 && argc != 5) || !v)
+			return error(i, "Invalid command %s: expected map string ?start?", argv[1]);
+		return mapFind(i, v, argv[3], argc == 5 ? argv[4] : NULL);
+	}
+	if (!strcmp("foreach-line", argv[1])) {
+		if (argc != 5 || !v)
+			return error(i, "Invalid command %s: expected map variable body", argv[1]);
+		return mapForEachLine(i, m, argv[2], argv[3], argv[4]);
+	}
 	return error(i, "Invalid subcommand %s", argv[1]);
 }
 
 static int pickleCommandGets(pickle_t *i, int argc, char **argv, void *pd) {
-	if (argc != 1)
-		return error(i, "Invalid command %s", argv[0]);
+	if (argc != 1 && argc != 2)
+		return error(i, "Invalid command %s: expected ?channel?", argv[0]);
+	channel_t *c = channel(pd, argc == 2 ? argv[1] : "stdin");
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	c->io = 1;
 	size_t length = 0;
-	char *line = pickle_slurp(i, (FILE*)pd, &length, "\n");
+	char *line = pickle_slurp(i, c->file, &length, "\n");
 	if (!line)
 		return error(i, "Out Of Memory");
 	if (!length) {
@@ -47,17 +378,228 @@ static int pickleCommandGets(pickle_t *i, int argc, char **argv, void *pd) {
 	return pickle_free(i, line) == PICKLE_OK ? r : PICKLE_ERROR;
 }
 
+static int pickleCommandOpen(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mod_t *m = pd;
+	if (argc != 2 && argc != 3)
+		return error(i, "Invalid command %s: expected file ?r|w|a|r+|w+|a+?", argv[0]);
+	static const char *modes[] = { "r", "w", "a", "r+", "w+", "a+", };
+	const char *mode = argc == 3 ? argv[2] : "r";
+	char fmode[4] = { 0 };
+	for (size_t j = 0; j < NELEMS(modes) && !fmode[0]; j++)
+		if (!strcmp(modes[j], mode))
+			snprintf(fmode, sizeof fmode, "%sb", mode);
+	if (!fmode[0])
+		return error(i, "Invalid mode %s", mode);
+	channel_t *c = pickle_allocate(i, sizeof *c);
+	if (!c)
+		return error(i, "Out Of Memory");
+	c->type = TAG_CHANNEL;
+	c->mode = -1;
+	snprintf(c->name, sizeof c->name, "file%p", (void*)c);
+	errno = 0;
+	if (!(c->file = fopen(argv[1], fmode))) {
+		const int e = errno;
+		(void)pickle_free(i, c);
+		return error(i, "open '%s' failed: %s", argv[1], strerror(e));
+	}
+	if (pickle_mod_tag_add(m, c->name, c) != PICKLE_OK) {
+		(void)channelClose(c);
+		(void)pickle_free(i, c);
+		return error(i, "Out Of Memory");
+	}
+	return ok(i, "%s", c->name);
+}
+
+static int pickleCommandClose(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc != 2)
+		return error(i, "Invalid command %s: expected channel", argv[0]);
+	channel_t *c = channel(pd, argv[1]);
+	if (!c || c->file == stdin || c->file == stdout || c->file == stderr)
+		return error(i, "Invalid channel %s", argv[1]);
+	/* 'cleanup' closes the file, check for errors writing out buffered data first */
+	errno = 0;
+	const int r = fflush(c->file) < 0 ? error(i, "close '%s' failed: %s", argv[1], strerror(errno)) : PICKLE_OK;
+	if (pickle_mod_tag_remove(pd, argv[1]) != PICKLE_OK)
+		return r == PICKLE_OK ? error(i, "close '%s' failed", argv[1]) : r;
+	return r;
+}
+
+static int pickleCommandRead(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc != 2 && argc != 4)
+		return error(i, "Invalid command %s: expected ?-size bytes? channel", argv[0]);
+	long size = -1;
+	if (argc == 4) {
+		if (strcmp(argv[1], "-size"))
+			return error(i, "Invalid option %s", argv[1]);
+		if (sscanf(argv[2], "%ld", &size) != 1 || size < 0)
+			return error(i, "Invalid size %s", argv[2]);
+	}
+	channel_t *c = channel(pd, argv[argc - 1]);
+	if (!c)
+		return error(i, "Invalid channel %s", argv[argc - 1]);
+	c->io = 1;
+	size_t length = 0;
+	char *block = NULL;
+	if (size < 0) {
+		block = pickle_slurp(i, c->file, &length, NULL);
+	} else { /* the size may be far more than is left, so grow as it is read */
+		for (size_t have = 0;;) {
+			const size_t next = MIN((size_t)size, have ? have * 2 : READ_CHUNK);
+			if (!(block = pickle_realloc(i, block, next + 1))) /* not zeroed, frees 'block' on failure */
+				break;
+			have = next;
+			length += fread(block + length, 1, have - length, c->file);
+			if (length < have || have == (size_t)size)
+				break;
+		}
+		if (block)
+			block[length] = '\0';
+	}
+	if (!block)
+		return error(i, "Out Of Memory");
+	const int r = ferror(c->file) ? error(i, "read '%s' failed", argv[argc - 1]) : ok(i, "%s", block);
+	return pickle_free(i, block) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+static int pickleCommandWrite(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc != 3)
+		return error(i, "Invalid command %s: expected channel string", argv[0]);
+	channel_t *c = channel(pd, argv[1]);
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	return channelWrite(c, argv[2], 0) == PICKLE_OK ? PICKLE_OK : error(i, "write '%s' failed", argv[1]);
+}
+
+static int pickleCommandSeek(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc != 3 && argc != 4)
+		return error(i, "Invalid command %s: expected channel offset ?start|current|end?", argv[0]);
+	channel_t *c = channel(pd, argv[1]);
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	c->io = 1;
+	long long offset = 0;
+	if (sscanf(argv[2], "%lld", &offset) != 1)
+		return error(i, "Invalid offset %s", argv[2]);
+	const char *origin = argc == 4 ? argv[3] : "start";
+	int whence = SEEK_SET;
+	if (!strcmp(origin, "current"))
+		whence = SEEK_CUR;
+	else if (!strcmp(origin, "end"))
+		whence = SEEK_END;
+	else if (strcmp(origin, "start"))
+		return error(i, "Invalid origin %s", origin);
+	errno = 0;
+#ifndef _WIN32
+	const int r = fseeko(c->file, offset, whence);
+#else
+	const int r = _fseeki64(c->file, offset, whence);
+#endif
+	return r < 0 ? error(i, "seek '%s' failed: %s", argv[1], strerror(errno)) : PICKLE_OK;
+}
+
+static int pickleCommandTell(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc != 2)
+		return error(i, "Invalid command %s: expected channel", argv[0]);
+	channel_t *c = channel(pd, argv[1]);
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	c->io = 1;
+	errno = 0;
+#ifndef _WIN32
+	const long long r = ftello(c->file);
+#else
+	const long long r = _ftelli64(c->file);
+#endif
+	return r < 0 ? error(i, "tell '%s' failed: %s", argv[1], strerror(errno)) : ok(i, "%lld", r);
+}
+
+static int pickleCommandEof(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc != 2)
+		return error(i, "Invalid command %s: expected channel", argv[0]);
+	channel_t *c = channel(pd, argv[1]);
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	c->io = 1;
+	return ok(i, "%d", !!feof(c->file));
+}
+
 static int pickleCommandPuts(pickle_t *i, int argc, char **argv, void *pd) {
-	FILE *out = pd;
-	if (argc != 1 && argc != 2 && argc != 3)
-		return error(i, "Invalid command %s", argv[0]);
-	if (argc == 1)
-		return fputc('\n', out) < 0 ? PICKLE_ERROR : PICKLE_OK;
+	if (argc < 1 || argc > 4)
+		return error(i, "Invalid command %s: expected ?-nonewline? ?channel? string", argv[0]);
+	int newline = 1;
+	if (argc > 2 && !strcmp(argv[1], "-nonewline")) {
+		newline = 0;
+		argc--;
+		argv++;
+	}
+	if (argc > 3)
+		return error(i, "Invalid option %s", argv[1]);
+	channel_t *c = channel(pd, argc == 3 ? argv[1] : "stdout");
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	return channelWrite(c, argc == 1 ? "" : argv[argc - 1], newline);
+}
+
+static int pickleCommandFlush(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc != 1 && argc != 2)
+		return error(i, "Invalid command %s: expected ?channel?", argv[0]);
+	channel_t *c = channel(pd, argc == 2 ? argv[1] : "stdout");
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	c->io = 1;
+	return fflush(c->file) < 0 ? error(i, "flush failed: %s", strerror(errno)) : PICKLE_OK;
+}
+
+static int pickleCommandFConfigure(pickle_t *i, int argc, char **argv, void *pd) {
+	if (argc < 2 || (argc % 2))
+		return error(i, "Invalid command %s: expected channel ?-buffering full|line|none? ?-buffersize bytes?", argv[0]);
+	channel_t *c = channel(pd, argv[1]);
+	if (!c)
+		return error(i, "Invalid channel %s", argv[1]);
+	static const char *modes[] = { [_IOFBF] = "full", [_IOLBF] = "line", [_IONBF] = "none", };
+	int mode = channelMode(c);
+	long size = c->size;
+	for (int j = 2; j < argc; j += 2) {
+		if (!strcmp(argv[j], "-buffering")) {
+			mode = -1;
+			for (size_t k = 0; k < NELEMS(modes); k++)
+				if (modes[k] && !strcmp(modes[k], argv[j + 1]))
+					mode = k;
+			if (mode < 0)
+				return error(i, "Invalid buffering mode %s", argv[j + 1]);
+		} else if (!strcmp(argv[j], "-buffersize")) {
+			char unit = 0;
+			const int n = sscanf(argv[j + 1], "%ld%c", &size, &unit);
+			if (n < 1 || size < 0 || (n == 2 && unit != 'k' && unit != 'K' && unit != 'm' && unit != 'M'))
+				return error(i, "Invalid buffer size %s", argv[j + 1]);
+			size *= n == 2 ? ((unit == 'k' || unit == 'K') ? 1024l : 1024l * 1024l) : 1l;
+		} else {
+			return error(i, "Invalid option %s", argv[j]);
+		}
+	}
 	if (argc == 2)
-		return fprintf(out, "%s\n", argv[1]) < 0 ? PICKLE_ERROR : PICKLE_OK;
-	if (!strcmp(argv[1], "-nonewline"))
-		return fputs(argv[2], out) < 0 ? PICKLE_ERROR : PICKLE_OK;
-	return error(i, "Invalid option %s", argv[1]);
+		return ok(i, "-buffering %s -buffersize %ld", modes[mode], mode == _IONBF ? 0l : (long)(c->size ? c->size : BUFSIZ));
+	if (c->io)
+		return error(i, "Could not configure channel %s: buffering can only be set before it is used", argv[1]);
+	char *buffer = NULL;
+	if (mode != _IONBF && size) {
+		if (c->buffer && (size_t)size == c->size) {
+			buffer = c->buffer; /* reuse, the same size was asked for */
+		} else if (!(buffer = malloc(size))) {
+			return error(i, "Out Of Memory");
+		}
+	}
+	if (setvbuf(c->file, buffer, mode, size) != 0) {
+		if (buffer != c->buffer)
+			free(buffer);
+		return error(i, "Could not configure channel %s", argv[1]);
+	}
+	if (c->buffer != buffer) /* nothing has been written through it */
+		free(c->buffer);
+	c->buffer = buffer;
+	c->size = buffer ? (size_t)size : 0;
+	c->mode = mode;
+	return PICKLE_OK;
 }
 
 static int pickleCommandGetEnv(pickle_t *i, int argc, char **argv, void *pd) {
@@ -77,11 +619,82 @@ static int pickleCommandExit(pickle_t *i, int argc, char **argv, void *pd) {
 	return PICKLE_ERROR; /* unreachable */
 }
 
+static int compare(const void *a, const void *b) {
+	const unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+	return (x > y) - (x < y);
+}
+
+static unsigned long long rank(const unsigned long long *sorted, size_t length, unsigned percent) {
+	assert(sorted);
+	assert(length);
+	const size_t k = ((percent * length) + 99) / 100; /* nearest rank */
+	return sorted[k ? MIN(k, length) - 1 : 0];
+}
+
+static int pickleCommandBenchmark(pickle_t *i, int argc, char **argv, void *pd) {
+	UNUSED(pd);
+	long iterations = 100, warmup = 10;
+	int j = 1;
+	for (; j < argc - 1; j += 2) {
+		long *v = NULL;
+		if (!strcmp(argv[j], "-iterations"))
+			v = &iterations;
+		else if (!strcmp(argv[j], "-warmup"))
+			v = &warmup;
+		else
+			return error(i, "Invalid option %s", argv[j]);
+		if (j + 1 >= argc - 1 || sscanf(argv[j + 1], "%ld", v) != 1 || *v < 0)
+			return error(i, "Invalid command %s: expected ?-iterations N? ?-warmup N? script", argv[0]);
+	}
+	if (j != argc - 1 || iterations < 1)
+		return error(i, "Invalid command %s: expected ?-iterations N? ?-warmup N? script", argv[0]);
+	const char *script = argv[argc - 1];
+	unsigned long long *times = pickle_allocate(i, iterations * sizeof *times);
+	if (!times)
+		return error(i, "Out Of Memory");
+	int r = PICKLE_OK;
+	for (long k = 0; k < warmup && r == PICKLE_OK; k++)
+		r = pickle_eval(i, script);
+	heap_t *h = pickle_mod_heap(i); /* NULL if another allocator is in use */
+	const long allocs = h ? h->allocs : 0, total = h ? h->total : 0;
+	unsigned long long elapsed = 0;
+	for (long k = 0; k < iterations && r == PICKLE_OK; k++) {
+		const unsigned long long start = pickle_mod_clock();
+		r = pickle_eval(i, script);
+		times[k] = pickle_mod_clock() - start;
+		elapsed += times[k];
+	}
+	if (r != PICKLE_OK) {
+		(void)pickle_free(i, times);
+		return r;
+	}
+	const double n = iterations;
+	const double allocated = h ? (h->allocs - allocs) / n : -1, bytes = h ? (h->total - total) / n : -1;
+	qsort(times, iterations, sizeof *times, compare);
+	r = ok(i, "{iterations %ld} {min %llu} {median %llu} {p90 %llu} {p99 %llu} {max %llu} {ops %.1f} {allocations %.1f} {bytes %.1f}",
+		iterations, times[0], rank(times, iterations, 50), rank(times, iterations, 90), rank(times, iterations, 99), times[iterations - 1],
+		elapsed ? n / ((double)elapsed / 1e9) : 0.0, allocated, bytes);
+	return pickle_free(i, times) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
 static int pickleCommandClock(pickle_t *i, const int argc, char **argv, void *pd) {
 	UNUSED(pd);
 	time_t ts = 0;
 	if (argc < 2)
 		return error(i, "Invalid command %s", argv[0]);
+	if (!strcmp(argv[1], "monotonic")) {
+		const char *unit = argc == 3 ? argv[2] : "-ns";
+		if (argc > 3)
+			return error(i, "Invalid subcommand %s: expected ?-ns|-us|-ms?", argv[1]);
+		const unsigned long long t = pickle_mod_clock();
+		if (!strcmp(unit, "-ns"))
+			return ok(i, "%llu", t);
+		if (!strcmp(unit, "-us"))
+			return ok(i, "%llu", t / 1000ull);
+		if (!strcmp(unit, "-ms"))
+			return ok(i, "%llu", t / 1000000ull);
+		return error(i, "Invalid unit %s", unit);
+	}
 	if (!strcmp(argv[1], "clicks")) {
 		const long t = (((double)(clock()) / (double)CLOCKS_PER_SEC) * 1000.0);
 		return ok(i, "%ld", t);
@@ -106,19 +719,60 @@ static int pickleCommandClock(pickle_t *i, const int argc, char **argv, void *pd
 }
 
 static int cleanup(pickle_mod_t *m, void *tag) {
-	UNUSED(m);
-	UNUSED(tag);
-	return PICKLE_OK;
+	assert(m);
+	int r = PICKLE_OK;
+	if (*(int*)tag == TAG_CHANNEL) {
+		channel_t *c = tag;
+		if (m->mods && pickle_mod_event_forget(m->mods, fileno(c->file)) != PICKLE_OK)
+			r = PICKLE_ERROR;
+		if (channelClose(c) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	} else if (*(int*)tag == TAG_MAP) {
+		r = mapClose(tag);
+	} else {
+		channels_t *cs = tag;
+		for (size_t j = 0; j < NELEMS(cs->std); j++)
+			if (fflush(cs->std[j].file) < 0)
+				r = PICKLE_ERROR;
+	}
+	return pickle_free(m->i, tag) == PICKLE_OK ? r : PICKLE_ERROR;
 }	
 
+static int init(pickle_mod_t *m) {
+	assert(m);
+	channels_t *cs = pickle_allocate(m->i, sizeof *cs);
+	if (!cs)
+		return PICKLE_ERROR;
+	cs->type = TAG_CHANNELS;
+	cs->std[0] = (channel_t){ .type = TAG_CHANNEL, .name = "stdin",  .file = stdin,  .mode = -1, };
+	cs->std[1] = (channel_t){ .type = TAG_CHANNEL, .name = "stdout", .file = stdout, .mode = -1, };
+	cs->std[2] = (channel_t){ .type = TAG_CHANNEL, .name = "stderr", .file = stderr, .mode = -1, };
+	if (pickle_mod_tag_add(m, "channels", cs) != PICKLE_OK) {
+		(void)pickle_free(m->i, cs);
+		return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
 int pickleModCRegister(pickle_mod_t *m) {
 	assert(m);
+	m->init = init;
 	m->cleanup = cleanup;
 	pickle_command_t cmds[] = { 
-		{ "gets",    pickleCommandGets,    stdin }, 
-		{ "puts",    pickleCommandPuts,    stdout }, 
+		{ "gets",    pickleCommandGets,    m }, 
+		{ "open",    pickleCommandOpen,    m }, 
+		{ "close",   pickleCommandClose,   m }, 
+		{ "read",    pickleCommandRead,    m }, 
+		{ "write",   pickleCommandWrite,   m }, 
+		{ "seek",    pickleCommandSeek,    m }, 
+		{ "tell",    pickleCommandTell,    m }, 
+		{ "eof",     pickleCommandEof,     m }, 
+		{ "puts",    pickleCommandPuts,    m }, 
+		{ "flush",   pickleCommandFlush,   m }, 
+		{ "fconfigure", pickleCommandFConfigure, m }, 
 		{ "getenv",  pickleCommandGetEnv,  m }, 
 		{ "clock",   pickleCommandClock,   m }, 
+		{ "benchmark", pickleCommandBenchmark, m }, 
 		{ "exit",    pickleCommandExit,    m }, 
 		{ "file",    pickleCommandFile,    m }, 
 	};
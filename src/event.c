@@ -0,0 +1,552 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mod.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+/* An event loop in the style of TCL's: 'after' schedules scripts to run
+ * after a delay or when the loop is idle, 'fileevent' runs scripts when a
+ * channel becomes readable or writable, and 'vwait' and 'update' run the
+ * loop. It is built on 'epoll', with a single 'timerfd' armed for the
+ * earliest timer, so waiting on many timers and files costs one system
+ * call. Errors in event scripts are returned from 'vwait' or 'update'.
+ *
+ * Readable events are for the underlying file descriptor, data already
+ * buffered in a channel by 'gets' or 'read' does not trigger them. Handlers
+ * are kept by file descriptor, the 'c' module removes them when it closes a
+ * channel so that a descriptor number reused by a later 'open' starts with
+ * none.
+ *
+ * Other modules can put their own descriptors and timers on the loop from
+ * C, with 'pickle_mod_event_watch' and 'pickle_mod_event_after', to run
+ * requests in the background whilst a script waits in 'vwait'. */
+
+#ifdef __linux__
+
+#define EVENT_BATCH (64)
+
+typedef struct {
+	unsigned long id;
+	unsigned long long due; /* from 'pickle_mod_clock', in nanoseconds */
+	char *script;
+	pickle_mod_event_t fn; /* called instead of a script if set */
+	void *data;
+} event_timer_t;
+
+typedef struct {
+	int fd;
+	char *script[2]; /* readable, writable */
+	pickle_mod_event_t fn; /* called when readable instead of the scripts */
+	void *data;
+} event_file_t;
+
+typedef struct {
+	event_timer_t *items;
+	size_t length, size;
+} event_timers_t;
+
+typedef struct {
+	int epoll, timer;
+	event_timers_t timers; /* sorted by when they are due */
+	event_timers_t idle;
+	event_file_t *files;
+	size_t files_length, files_size;
+	unsigned long ids;
+} event_t;
+
+static int timerAdd(pickle_t *i, event_timers_t *ts, unsigned long id, unsigned long long due, const char *script, pickle_mod_event_t fn, void *data) {
+	assert(ts);
+	assert(script || fn);
+	if (ts->length >= ts->size) {
+		const size_t size = ts->size ? ts->size * 2 : 16;
+		event_timer_t *items = pickle_allocate(i, size * sizeof *items);
+		if (!items)
+			return PICKLE_ERROR;
+		if (ts->length)
+			memcpy(items, ts->items, ts->length * sizeof *items);
+		(void)pickle_free(i, ts->items);
+		ts->items = items;
+		ts->size = size;
+	}
+	char *s = NULL;
+	if (script) {
+		const size_t l = strlen(script);
+		if (!(s = pickle_allocate(i, l + 1)))
+			return PICKLE_ERROR;
+		memcpy(s, script, l + 1);
+	}
+	size_t lo = 0, hi = ts->length; /* after any timers due at the same time */
+	while (lo < hi) {
+		const size_t mid = lo + ((hi - lo) / 2);
+		if (ts->items[mid].due <= due)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	memmove(&ts->items[lo + 1], &ts->items[lo], (ts->length - lo) * sizeof *ts->items);
+	ts->items[lo] = (event_timer_t){ .id = id, .due = due, .script = s, .fn = fn, .data = data, };
+	ts->length++;
+	return PICKLE_OK;
+}
+
+static void timerRemove(event_timers_t *ts, size_t index) {
+	assert(ts);
+	assert(index < ts->length);
+	memmove(&ts->items[index], &ts->items[index + 1], (ts->length - index - 1) * sizeof *ts->items);
+	ts->length--;
+}
+
+/* Arm the timer file descriptor for the earliest timer, or disarm it */
+static int timerArm(event_t *e) {
+	assert(e);
+	struct itimerspec its = { .it_value = { 0, 0 } };
+	if (e->timers.length) {
+		const unsigned long long due = MAX(e->timers.items[0].due, 1ull); /* zero would disarm it */
+		its.it_value.tv_sec = due / 1000000000ull;
+		its.it_value.tv_nsec = due % 1000000000ull;
+	}
+	return timerfd_settime(e->timer, TFD_TIMER_ABSTIME, &its, NULL) < 0 ? PICKLE_ERROR : PICKLE_OK;
+}
+
+static event_file_t *fileFind(event_t *e, int fd) {
+	assert(e);
+	for (size_t j = 0; j < e->files_length; j++)
+		if (e->files[j].fd == fd)
+			return &e->files[j];
+	return NULL;
+}
+
+static event_file_t *fileAdd(pickle_t *i, event_t *e, int fd) {
+	assert(e);
+	if (e->files_length >= e->files_size) {
+		const size_t size = e->files_size ? e->files_size * 2 : 16;
+		event_file_t *files = pickle_allocate(i, size * sizeof *files);
+		if (!files)
+			return NULL;
+		if (e->files_length)
+			memcpy(files, e->files, e->files_length * sizeof *files);
+		(void)pickle_free(i, e->files);
+		e->files = files;
+		e->files_size = size;
+	}
+	event_file_t *f = &e->files[e->files_length++];
+	*f = (event_file_t){ .fd = fd, };
+	return f;
+}
+
+static int fileUpdate(pickle_t *i, event_t *e, int fd, int writable, const char *script) {
+	assert(e);
+	event_file_t *f = fileFind(e, fd);
+	const int existed = f != NULL;
+	if (existed && f->fn) /* not a channel */
+		return PICKLE_ERROR;
+	if (!f) {
+		if (!script[0])
+			return PICKLE_OK;
+		if (!(f = fileAdd(i, e, fd)))
+			return PICKLE_ERROR;
+	}
+	char *s = NULL;
+	if (script[0]) {
+		const size_t l = strlen(script);
+		if (!(s = pickle_allocate(i, l + 1)))
+			return PICKLE_ERROR;
+		memcpy(s, script, l + 1);
+	}
+	(void)pickle_free(i, f->script[writable]);
+	f->script[writable] = s;
+	struct epoll_event ev = { .events = (f->script[0] ? EPOLLIN : 0) | (f->script[1] ? EPOLLOUT : 0), .data.fd = fd, };
+	int r = 0;
+	if (!ev.events) {
+		r = epoll_ctl(e->epoll, EPOLL_CTL_DEL, fd, NULL);
+		*f = e->files[--e->files_length];
+	} else {
+		r = epoll_ctl(e->epoll, existed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+		if (r < 0 && existed && errno == ENOENT) /* closed behind our back, and reused */
+			r = epoll_ctl(e->epoll, EPOLL_CTL_ADD, fd, &ev);
+		if (r < 0 && !existed) {
+			(void)pickle_free(i, s);
+			*f = e->files[--e->files_length];
+		}
+	}
+	return r < 0 ? PICKLE_ERROR : PICKLE_OK;
+}
+
+/* The loop of a set of modules, if it is running, or after starting it if
+ * 'start' is set */
+static event_t *eventLoop(pickle_mods_t *ms, pickle_mod_t **m, int start) {
+	assert(ms);
+	assert(m);
+	*m = pickle_mod_find(ms, "event");
+	if (!*m || (start ? pickle_mod_ready(*m) != PICKLE_OK : (*m)->state != PICKLE_MOD_READY))
+		return NULL;
+	return pickle_mod_tag_find(*m, "loop");
+}
+
+/* Call 'fn' whenever 'fd' is readable, until it is forgotten */
+int pickle_mod_event_watch(pickle_mods_t *ms, int fd, pickle_mod_event_t fn, void *data) {
+	assert(fn);
+	pickle_mod_t *m = NULL;
+	event_t *e = eventLoop(ms, &m, 1);
+	if (!e || fileFind(e, fd))
+		return PICKLE_ERROR;
+	event_file_t *f = fileAdd(m->i, e, fd);
+	if (!f)
+		return PICKLE_ERROR;
+	f->fn = fn;
+	f->data = data;
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd, };
+	if (epoll_ctl(e->epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		e->files_length--;
+		return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+/* Call 'fn', with a file descriptor of -1, after 'ms_delay' milliseconds */
+int pickle_mod_event_after(pickle_mods_t *ms, long ms_delay, pickle_mod_event_t fn, void *data, unsigned long *id) {
+	assert(fn);
+	assert(id);
+	pickle_mod_t *m = NULL;
+	event_t *e = eventLoop(ms, &m, 1);
+	if (!e)
+		return PICKLE_ERROR;
+	const unsigned long long due = pickle_mod_clock() + (MAX(ms_delay, 0l) * 1000000ull);
+	if (timerAdd(m->i, &e->timers, ++e->ids, due, NULL, fn, data) != PICKLE_OK)
+		return PICKLE_ERROR;
+	*id = e->ids;
+	return timerArm(e);
+}
+
+int pickle_mod_event_cancel(pickle_mods_t *ms, unsigned long id) {
+	pickle_mod_t *m = NULL;
+	event_t *e = eventLoop(ms, &m, 0);
+	if (!e)
+		return PICKLE_OK;
+	for (size_t j = 0; j < e->timers.length; j++)
+		if (e->timers.items[j].id == id) {
+			(void)pickle_free(m->i, e->timers.items[j].script);
+			timerRemove(&e->timers, j);
+			return timerArm(e);
+		}
+	return PICKLE_OK;
+}
+
+/* Remove the handlers for a file descriptor that is about to be closed, it
+ * has to be taken out of the 'epoll' set first whilst it is still open. */
+int pickle_mod_event_forget(pickle_mods_t *ms, int fd) {
+	pickle_mod_t *m = NULL;
+	event_t *e = eventLoop(ms, &m, 0);
+	event_file_t *f = e ? fileFind(e, fd) : NULL;
+	if (!f)
+		return PICKLE_OK;
+	const int r = epoll_ctl(e->epoll, EPOLL_CTL_DEL, fd, NULL) < 0 ? PICKLE_ERROR : PICKLE_OK;
+	(void)pickle_free(m->i, f->script[0]);
+	(void)pickle_free(m->i, f->script[1]);
+	*f = e->files[--e->files_length];
+	return r;
+}
+
+/* Evaluate a copy of an event script, the original may be changed or freed
+ * by the script itself */
+static int run(pickle_t *i, const char *script) {
+	assert(script);
+	const size_t l = strlen(script);
+	char *s = pickle_allocate(i, l + 1);
+	if (!s)
+		return error(i, "Out Of Memory");
+	memcpy(s, script, l + 1);
+	const int r = pickle_eval(i, s);
+	return pickle_free(i, s) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+static int runTimers(pickle_t *i, event_t *e) {
+	assert(e);
+	uint64_t expirations = 0;
+	if (read(e->timer, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+		return error(i, "Timer read failed: %s", strerror(errno));
+	const unsigned long long now = pickle_mod_clock();
+	int r = PICKLE_OK;
+	while (r == PICKLE_OK && e->timers.length && e->timers.items[0].due <= now) {
+		const event_timer_t t = e->timers.items[0];
+		timerRemove(&e->timers, 0);
+		r = t.fn ? t.fn(i, -1, t.data) : pickle_eval(i, t.script);
+		(void)pickle_free(i, t.script);
+	}
+	return r;
+}
+
+static int runIdle(pickle_t *i, event_t *e) {
+	assert(e);
+	event_timers_t idle = e->idle; /* scripts scheduled by these run next time */
+	e->idle = (event_timers_t){ .items = NULL, };
+	int r = PICKLE_OK;
+	size_t j = 0;
+	for (; j < idle.length && r == PICKLE_OK; j++) {
+		r = pickle_eval(i, idle.items[j].script);
+		(void)pickle_free(i, idle.items[j].script);
+	}
+	for (; j < idle.length; j++) /* put back what did not run */
+		if (timerAdd(i, &e->idle, idle.items[j].id, 0, idle.items[j].script, NULL, NULL) != PICKLE_OK)
+			r = error(i, "Out Of Memory");
+		else
+			(void)pickle_free(i, idle.items[j].script);
+	(void)pickle_free(i, idle.items);
+	return r;
+}
+
+/* Run one round of events, returns the number of events handled, zero if
+ * there was nothing to wait for, or a negative value on error. */
+static int eventOnce(pickle_t *i, event_t *e, int block) {
+	assert(e);
+	const int waiting = e->timers.length || e->files_length;
+	if (!waiting && !e->idle.length)
+		return 0;
+	struct epoll_event evs[EVENT_BATCH];
+	int n = 0;
+	do
+		n = epoll_wait(e->epoll, evs, EVENT_BATCH, block && !e->idle.length ? -1 : 0);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return error(i, "Event wait failed: %s", strerror(errno));
+	int handled = 0;
+	for (int j = 0; j < n; j++) {
+		int r = PICKLE_OK;
+		if (evs[j].data.fd == e->timer) {
+			r = runTimers(i, e);
+		} else {
+			event_file_t *f = fileFind(e, evs[j].data.fd);
+			if (f && f->fn) {
+				if (evs[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					r = f->fn(i, f->fd, f->data);
+			} else for (int w = 0; w < 2 && r == PICKLE_OK; w++) {
+				f = fileFind(e, evs[j].data.fd); /* the previous script may have removed it */
+				const int ready = evs[j].events & (w ? EPOLLOUT | EPOLLERR : EPOLLIN | EPOLLHUP | EPOLLERR);
+				if (f && f->script[w] && ready)
+					r = run(i, f->script[w]);
+			}
+		}
+		if (r != PICKLE_OK)
+			return timerArm(e), PICKLE_ERROR;
+		handled++;
+	}
+	if (!handled && e->idle.length) {
+		if (runIdle(i, e) != PICKLE_OK)
+			return timerArm(e), PICKLE_ERROR;
+		handled = 1;
+	}
+	if (timerArm(e) != PICKLE_OK)
+		return error(i, "Timer set failed: %s", strerror(errno));
+	return handled;
+}
+
+static int pickleCommandAfter(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mod_t *m = pd;
+	event_t *e = pickle_mod_tag_find(m, "loop");
+	assert(e);
+	if (argc == 3 && !strcmp(argv[1], "cancel")) {
+		unsigned long id = 0;
+		if (sscanf(argv[2], "after#%lu", &id) != 1)
+			return error(i, "Invalid event %s", argv[2]);
+		event_timers_t *lists[] = { &e->timers, &e->idle, };
+		for (size_t l = 0; l < NELEMS(lists); l++)
+			for (size_t j = 0; j < lists[l]->length; j++)
+				if (lists[l]->items[j].id == id && !lists[l]->items[j].fn) { /* not another module's */
+					(void)pickle_free(i, lists[l]->items[j].script);
+					timerRemove(lists[l], j);
+					return timerArm(e) == PICKLE_OK ? PICKLE_OK : error(i, "Timer set failed: %s", strerror(errno));
+				}
+		return PICKLE_OK; /* already run or cancelled */
+	}
+	if (argc == 3 && !strcmp(argv[1], "idle")) {
+		if (timerAdd(i, &e->idle, ++e->ids, 0, argv[2], NULL, NULL) != PICKLE_OK)
+			return error(i, "Out Of Memory");
+		return ok(i, "after#%lu", e->ids);
+	}
+	long ms = 0;
+	if (argc != 3 || sscanf(argv[1], "%ld", &ms) != 1 || ms < 0)
+		return error(i, "Invalid command %s: expected ms script *OR* idle script *OR* cancel id", argv[0]);
+	const unsigned long long due = pickle_mod_clock() + (ms * 1000000ull);
+	if (timerAdd(i, &e->timers, ++e->ids, due, argv[2], NULL, NULL) != PICKLE_OK)
+		return error(i, "Out Of Memory");
+	if (timerArm(e) != PICKLE_OK)
+		return error(i, "Timer set failed: %s", strerror(errno));
+	return ok(i, "after#%lu", e->ids);
+}
+
+static int pickleCommandFileEvent(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mod_t *m = pd;
+	event_t *e = pickle_mod_tag_find(m, "loop");
+	assert(e);
+	if ((argc != 3 && argc != 4) || (strcmp(argv[2], "readable") && strcmp(argv[2], "writable")))
+		return error(i, "Invalid command %s: expected channel readable|writable ?script?", argv[0]);
+	FILE *file = pickle_mod_channel(m->mods, argv[1]);
+	if (!file)
+		return error(i, "Invalid channel %s", argv[1]);
+	const int fd = fileno(file), writable = argv[2][0] == 'w';
+	if (argc == 3) {
+		event_file_t *f = fileFind(e, fd);
+		return ok(i, "%s", f && f->script[writable] ? f->script[writable] : "");
+	}
+	if (fileUpdate(i, e, fd, writable, argv[3]) != PICKLE_OK)
+		return error(i, "fileevent '%s' failed: %s", argv[1], strerror(errno));
+	return PICKLE_OK;
+}
+
+static int pickleCommandVWait(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mod_t *m = pd;
+	event_t *e = pickle_mod_tag_find(m, "loop");
+	assert(e);
+	if (argc != 2)
+		return error(i, "Invalid command %s: expected variable", argv[0]);
+	/* there are no variable traces, so the value is compared after each
+	 * round of events instead */
+	const char *value = NULL;
+	char *old = NULL;
+	if (pickle_var_get(i, argv[1], &value) == PICKLE_OK && value) {
+		const size_t l = strlen(value);
+		if (!(old = pickle_allocate(i, l + 1)))
+			return error(i, "Out Of Memory");
+		memcpy(old, value, l + 1);
+	}
+	int r = PICKLE_OK;
+	for (;;) {
+		const int n = eventOnce(i, e, 1);
+		if (n < 0) {
+			r = PICKLE_ERROR;
+			break;
+		}
+		value = NULL;
+		const int set = pickle_var_get(i, argv[1], &value) == PICKLE_OK && value;
+		if (set && (!old || strcmp(old, value)))
+			break;
+		if (n == 0) {
+			r = error(i, "vwait %s would wait forever", argv[1]);
+			break;
+		}
+	}
+	(void)pickle_free(i, old);
+	return r == PICKLE_OK ? ok(i, "") : r;
+}
+
+static int pickleCommandUpdate(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mod_t *m = pd;
+	event_t *e = pickle_mod_tag_find(m, "loop");
+	assert(e);
+	if (argc != 1)
+		return error(i, "Invalid command %s", argv[0]);
+	for (int n = 1; n > 0;)
+		if ((n = eventOnce(i, e, 0)) < 0)
+			return PICKLE_ERROR;
+	return ok(i, "");
+}
+
+static int init(pickle_mod_t *m) {
+	assert(m);
+	event_t *e = pickle_allocate(m->i, sizeof *e);
+	if (!e)
+		return PICKLE_ERROR;
+	e->epoll = epoll_create1(EPOLL_CLOEXEC);
+	e->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = e->timer, };
+	if (e->epoll < 0 || e->timer < 0
+		|| epoll_ctl(e->epoll, EPOLL_CTL_ADD, e->timer, &ev) < 0
+		|| pickle_mod_tag_add(m, "loop", e) != PICKLE_OK) {
+		if (e->epoll >= 0)
+			(void)close(e->epoll);
+		if (e->timer >= 0)
+			(void)close(e->timer);
+		(void)pickle_free(m->i, e);
+		return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	assert(m);
+	event_t *e = tag;
+	for (size_t j = 0; j < e->timers.length; j++)
+		(void)pickle_free(m->i, e->timers.items[j].script);
+	for (size_t j = 0; j < e->idle.length; j++)
+		(void)pickle_free(m->i, e->idle.items[j].script);
+	for (size_t j = 0; j < e->files_length; j++) {
+		(void)pickle_free(m->i, e->files[j].script[0]);
+		(void)pickle_free(m->i, e->files[j].script[1]);
+	}
+	(void)pickle_free(m->i, e->timers.items);
+	(void)pickle_free(m->i, e->idle.items);
+	(void)pickle_free(m->i, e->files);
+	const int r = close(e->epoll) < 0 || close(e->timer) < 0 ? PICKLE_ERROR : PICKLE_OK;
+	return pickle_free(m->i, e) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+#else
+
+int pickle_mod_event_forget(pickle_mods_t *ms, int fd) {
+	UNUSED(ms);
+	UNUSED(fd);
+	return PICKLE_OK;
+}
+
+int pickle_mod_event_watch(pickle_mods_t *ms, int fd, pickle_mod_event_t fn, void *data) {
+	UNUSED(ms);
+	UNUSED(fd);
+	UNUSED(fn);
+	UNUSED(data);
+	return PICKLE_ERROR;
+}
+
+int pickle_mod_event_after(pickle_mods_t *ms, long ms_delay, pickle_mod_event_t fn, void *data, unsigned long *id) {
+	UNUSED(ms);
+	UNUSED(ms_delay);
+	UNUSED(fn);
+	UNUSED(data);
+	UNUSED(id);
+	return PICKLE_ERROR;
+}
+
+int pickle_mod_event_cancel(pickle_mods_t *ms, unsigned long id) {
+	UNUSED(ms);
+	UNUSED(id);
+	return PICKLE_OK;
+}
+
+static int pickleCommandNotImplemented(pickle_t *i, int argc, char **argv, void *pd) {
+	UNUSED(argc);
+	UNUSED(pd);
+	return error(i, "Invalid command %s: not implemented", argv[0]);
+}
+
+#define pickleCommandAfter     pickleCommandNotImplemented
+#define pickleCommandFileEvent pickleCommandNotImplemented
+#define pickleCommandVWait     pickleCommandNotImplemented
+#define pickleCommandUpdate    pickleCommandNotImplemented
+#define init NULL
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	UNUSED(m);
+	UNUSED(tag);
+	return PICKLE_OK;
+}
+
+#endif
+
+int pickleModEventRegister(pickle_mod_t *m) {
+	assert(m);
+	pickle_command_t cmds[] = {
+		{ "after",      pickleCommandAfter,     m },
+		{ "fileevent",  pickleCommandFileEvent, m },
+		{ "vwait",      pickleCommandVWait,     m },
+		{ "update",     pickleCommandUpdate,    m },
+	};
+	m->init = init;
+	m->cleanup = cleanup;
+	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
+}
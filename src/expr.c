@@ -1,45 +1,197 @@
 #include "mod.h"
 #include "q.h"
 #include <assert.h>
+#include <ctype.h>
+#include <string.h>
+
+/* Variables referenced in an expression are resolved from the interpreter
+ * when 'expr' is evaluated, the string to number conversion is cached so
+ * that the same value does not get parsed over and over again in a loop. */
+
+#define EXPR_CACHE_SIZE (64)
+#define EXPR_CACHE_STRING (32)
+#define EXPR_SMALL (64)
+
+typedef struct {
+	char name[EXPR_CACHE_STRING], value[EXPR_CACHE_STRING];
+	q_t number;
+} expr_cache_entry_t;
+
+typedef struct {
+	expr_cache_entry_t entries[EXPR_CACHE_SIZE];
+} expr_cache_t;
+
+static unsigned long hash(const char *s) {
+	assert(s);
+	unsigned long h = 5381ul;
+	for (; *s; s++)
+		h = (h * 33ul) ^ (unsigned char)*s;
+	return h;
+}
+
+static int lookup(pickle_t *i, expr_cache_t *c, const char *name, q_t *n) {
+	assert(i);
+	assert(c);
+	assert(name);
+	assert(n);
+	const char *value = NULL;
+	if (pickle_var_get(i, name, &value) != PICKLE_OK || !value)
+		return 0;
+	expr_cache_entry_t *e = &c->entries[hash(name) % EXPR_CACHE_SIZE];
+	if (!strcmp(e->name, name) && !strcmp(e->value, value)) {
+		*n = e->number;
+		return 1;
+	}
+	if (qconv(n, value) < 0)
+		return -1;
+	const size_t nl = strlen(name), vl = strlen(value);
+	if (nl < sizeof (e->name) && vl < sizeof (e->value)) {
+		memcpy(e->name,  name,  nl + 1);
+		memcpy(e->value, value, vl + 1);
+		e->number = *n;
+	}
+	return 1;
+}
+
+/* Find all identifiers in 'expr' that name an interpreter variable, copying
+ * each name into 'names' so it can be referred to by a 'qvariable_t'. */
+static int resolve(pickle_t *i, expr_cache_t *c, const char *expr, char *names, qvariable_t *vs, qvariable_t **vars, size_t *count, size_t max) {
+	assert(expr);
+	assert(names);
+	assert(vs);
+	assert(vars);
+	assert(count);
+	for (const char *s = expr; *s;) {
+		if (isdigit((unsigned char)*s) || *s == '.') { /* skip numbers, and any suffix they might have */
+			while (isalnum((unsigned char)*s) || *s == '.' || *s == '_')
+				s++;
+			continue;
+		}
+		if (!isalpha((unsigned char)*s) && *s != '_') {
+			s++;
+			continue;
+		}
+		const char *start = s;
+		while (isalnum((unsigned char)*s) || *s == '_')
+			s++;
+		const size_t l = s - start;
+		const char *t = s;
+		while (isspace((unsigned char)*t))
+			t++;
+		if (*t == '(') /* function call */
+			continue;
+		memcpy(names, start, l);
+		names[l] = '\0';
+		int found = 0;
+		for (size_t j = 0; j < *count && !found; j++)
+			found = !strcmp(vars[j]->name, names);
+		if (found)
+			continue;
+		if (*count >= max)
+			return error(i, "Too many variables in expression %s", expr);
+		const int r = lookup(i, c, names, &vs[*count].value);
+		if (r < 0)
+			return error(i, "Invalid number in variable %s", names);
+		if (r == 0) /* leave it to 'qexpr' to complain about */
+			continue;
+		vs[*count].name = names;
+		vars[*count] = &vs[*count];
+		*count += 1;
+		names += l + 1;
+	}
+	return PICKLE_OK;
+}
 
 static int pickleCommandExpr(pickle_t *i, int argc, char **argv, void *pd) {
-	UNUSED(pd);
+	pickle_mod_t *m = pd;
 	if (argc != 2)
 		return error(i, "Invalid command %s", argv[0]);
-	const qoperations_t *ops[64];
-	q_t numbers[64];
-	qvariable_t e  = { "e",  qinfo.e };
-	qvariable_t pi = { "pi", qinfo.pi };
-	qvariable_t *vars[] = { &e, &pi };
+	expr_cache_t *c = pickle_mod_tag_find(m, "cache");
+	assert(c);
+	/* Each operator or number consumes at least one character of the
+	 * expression, so its length bounds the depth of both stacks. */
+	const size_t length = strlen(argv[1]), max = length + 2;
+	const qoperations_t *small_ops[EXPR_SMALL];
+	q_t small_numbers[EXPR_SMALL];
+	qvariable_t small_vs[EXPR_SMALL], *small_vars[EXPR_SMALL];
+	char small_names[EXPR_SMALL];
+	const qoperations_t **ops = small_ops;
+	q_t *numbers = small_numbers;
+	qvariable_t *vs = small_vs, **vars = small_vars;
+	char *names = small_names;
+	int r = PICKLE_ERROR;
+	if (max > EXPR_SMALL) {
+		ops     = pickle_allocate(i, max * sizeof *ops);
+		numbers = pickle_allocate(i, max * sizeof *numbers);
+		vs      = pickle_allocate(i, max * sizeof *vs);
+		vars    = pickle_allocate(i, max * sizeof *vars);
+		names   = pickle_allocate(i, max * sizeof *names);
+		if (!ops || !numbers || !vs || !vars || !names) {
+			(void)error(i, "Out Of Memory");
+			goto done;
+		}
+	}
+	size_t count = 0;
+	vs[count] = (qvariable_t){ "e",  qinfo.e };
+	vars[count] = &vs[count];
+	count++;
+	vs[count] = (qvariable_t){ "pi", qinfo.pi };
+	vars[count] = &vs[count];
+	count++;
+	if (resolve(i, c, argv[1], names, vs, vars, &count, max) != PICKLE_OK)
+		goto done;
 	qexpr_t expr = {
 		.ops         = ops,
 		.numbers     = numbers,
-		.ops_max     = NELEMS(ops),
-		.numbers_max = NELEMS(numbers),
+		.ops_max     = max,
+		.numbers_max = max,
 		.vars        = vars,
-		.vars_max    = NELEMS(vars),
+		.vars_max    = count,
 	};
-	const int r = qexpr(&expr, argv[1]);
-	if (r < 0)
-		return error(i, "Invalid expression %s: %s", argv[1], expr.error_string);
+	if (qexpr(&expr, argv[1]) < 0) {
+		(void)error(i, "Invalid expression %s: %s", argv[1], expr.error_string);
+		goto done;
+	}
 	char n[64] = { 0 };
-	if (qsprint(expr.numbers[0], n, sizeof n) < 0)
-		return error(i, "Numeric conversion failed in expr");
-	return ok(i, "%s", n);
+	if (qsprint(expr.numbers[0], n, sizeof n) < 0) {
+		(void)error(i, "Numeric conversion failed in expr");
+		goto done;
+	}
+	r = ok(i, "%s", n);
+done:
+	if (ops != small_ops) {
+		(void)pickle_free(i, ops);
+		(void)pickle_free(i, numbers);
+		(void)pickle_free(i, vs);
+		(void)pickle_free(i, vars);
+		(void)pickle_free(i, names);
+	}
+	return r;
 }
 
 static int cleanup(pickle_mod_t *m, void *tag) {
-	UNUSED(m);
-	UNUSED(tag);
+	assert(m);
+	return pickle_free(m->i, tag);
+}
+
+static int init(pickle_mod_t *m) {
+	assert(m);
+	expr_cache_t *c = pickle_allocate(m->i, sizeof *c);
+	if (!c)
+		return PICKLE_ERROR;
+	if (pickle_mod_tag_add(m, "cache", c) != PICKLE_OK) {
+		(void)pickle_free(m->i, c);
+		return PICKLE_ERROR;
+	}
 	return PICKLE_OK;
-}	
+}
 
 int pickleModExprRegister(pickle_mod_t *m) {
 	assert(m);
-	pickle_command_t cmds[] = { 
-		{ "expr",  pickleCommandExpr,  m }, 
+	pickle_command_t cmds[] = {
+		{ "expr",  pickleCommandExpr,  m },
 	};
+	m->init = init;
 	m->cleanup = cleanup;
 	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
 }
-
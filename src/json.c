@@ -0,0 +1,588 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mod.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* JSON to and from pickle lists. Objects become lists of alternating keys
+ * and values, arrays become lists, strings are decoded, and numbers, true,
+ * false and null are kept as they are written. A string containing
+ * '\u0000' is an error, as pickle strings end at the first NUL. 'json
+ * array' and 'json object' check that the values they are given are JSON.
+ *
+ * The parser makes one pass over the text, values are written straight
+ * into the result, with one reusable buffer per level of nesting, and
+ * strings without escapes are copied directly from the input. 'json get'
+ * skips everything off the path it is given without converting it. */
+
+#define JSON_DEPTH_MAX (128)
+#define JSON_CHUNK     (64ul * 1024ul)
+
+typedef struct {
+	pickle_t *i;
+	const char *start, *s, *end;
+	const char *error;
+	pickle_buffer_t scratch; /* for decoding strings with escapes */
+	pickle_buffer_t levels[JSON_DEPTH_MAX];
+} json_t;
+
+static void jsonInit(json_t *j, pickle_t *i, const char *s, size_t length) {
+	assert(j);
+	assert(s);
+	memset(j, 0, sizeof *j);
+	j->i = i;
+	j->start = j->s = s;
+	j->end = s + length;
+	j->scratch.i = i;
+	for (size_t k = 0; k < JSON_DEPTH_MAX; k++)
+		j->levels[k].i = i;
+}
+
+static void jsonReset(json_t *j, const char *s, size_t length) {
+	assert(j);
+	j->start = j->s = s;
+	j->end = s + length;
+	j->error = NULL;
+}
+
+static int jsonFree(json_t *j) {
+	assert(j);
+	int r = pickle_buffer_free(&j->scratch);
+	for (size_t k = 0; k < JSON_DEPTH_MAX; k++)
+		if (j->levels[k].buf && pickle_buffer_free(&j->levels[k]) != PICKLE_OK)
+			r = PICKLE_ERROR;
+	return r;
+}
+
+static int fail(json_t *j, const char *msg) {
+	assert(j);
+	if (!j->error)
+		j->error = msg;
+	return PICKLE_ERROR;
+}
+
+static int jsonError(json_t *j) {
+	assert(j);
+	return error(j->i, "json: %s at offset %ld", j->error ? j->error : "Out Of Memory", (long)(j->s - j->start));
+}
+
+static void ws(json_t *j) {
+	while (j->s < j->end && (*j->s == ' ' || *j->s == '\n' || *j->s == '\r' || *j->s == '\t'))
+		j->s++;
+}
+
+/* Find the first quote, backslash or control character, which are the
+ * only bytes in a string that need looking at */
+static const char *scan(const char *s, const char *end) {
+	assert(s);
+	assert(end);
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1F);
+	for (; end - s >= 16; s += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)s);
+		const __m128i q = _mm_cmpeq_epi8(v, quote);
+		const __m128i b = _mm_cmpeq_epi8(v, backslash);
+		const __m128i c = _mm_cmpeq_epi8(_mm_min_epu8(v, control), v); /* v <= 0x1F, unsigned */
+		const int bits = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(q, b), c));
+		if (bits)
+			return s + __builtin_ctz(bits);
+	}
+#endif
+	for (; s < end; s++)
+		if (*s == '"' || *s == '\\' || (unsigned char)*s < 0x20)
+			return s;
+	return end;
+}
+
+static int hex4(const char *s, unsigned long *u) {
+	assert(s);
+	assert(u);
+	*u = 0;
+	for (int k = 0; k < 4; k++) {
+		const char ch = s[k];
+		const int d = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+		if (d < 0)
+			return -1;
+		*u = (*u << 4) | d;
+	}
+	return 0;
+}
+
+static int utf8(pickle_buffer_t *b, unsigned long u) {
+	assert(b);
+	char e[4];
+	size_t l = 0;
+	if (u < 0x80) {
+		e[l++] = u;
+	} else if (u < 0x800) {
+		e[l++] = 0xC0 | (u >> 6);
+		e[l++] = 0x80 | (u & 0x3F);
+	} else if (u < 0x10000) {
+		e[l++] = 0xE0 | (u >> 12);
+		e[l++] = 0x80 | ((u >> 6) & 0x3F);
+		e[l++] = 0x80 | (u & 0x3F);
+	} else {
+		e[l++] = 0xF0 | (u >> 18);
+		e[l++] = 0x80 | ((u >> 12) & 0x3F);
+		e[l++] = 0x80 | ((u >> 6) & 0x3F);
+		e[l++] = 0x80 | (u & 0x3F);
+	}
+	return pickle_buffer_add(b, e, l);
+}
+
+/* Parse a string at the cursor, which must be on the opening quote. On
+ * success '*s' and '*l' are the contents, pointing into the input if there
+ * were no escapes or into the scratch buffer if there were. Nothing is
+ * decoded if 'decode' is zero. */
+static int string(json_t *j, const char **s, size_t *l, int decode) {
+	assert(j);
+	if (j->s >= j->end || *j->s != '"')
+		return fail(j, "expected string");
+	const char *begin = ++j->s;
+	int escaped = 0;
+	j->scratch.used = 0;
+	for (;;) {
+		const char *p = scan(j->s, j->end);
+		if (decode && escaped && p > j->s && pickle_buffer_add(&j->scratch, j->s, p - j->s) != PICKLE_OK)
+			return fail(j, "Out Of Memory");
+		j->s = p;
+		if (p >= j->end)
+			return fail(j, "unterminated string");
+		if (*p == '"')
+			break;
+		if ((unsigned char)*p < 0x20)
+			return fail(j, "control character in string");
+		if (decode && !escaped) { /* first escape, start copying */
+			escaped = 1;
+			if (p > begin && pickle_buffer_add(&j->scratch, begin, p - begin) != PICKLE_OK)
+				return fail(j, "Out Of Memory");
+		}
+		if (p + 1 >= j->end)
+			return fail(j, "unterminated string");
+		const char e = p[1];
+		const char *c = strchr("\"\\/bfnrt", e);
+		j->s = p + 2;
+		if (c && e) {
+			const char d = "\"\\/\b\f\n\r\t"[c - "\"\\/bfnrt"];
+			if (decode && pickle_buffer_add(&j->scratch, &d, 1) != PICKLE_OK)
+				return fail(j, "Out Of Memory");
+			continue;
+		}
+		if (e != 'u')
+			return fail(j, "invalid escape");
+		unsigned long u = 0, low = 0;
+		if (j->end - j->s < 4 || hex4(j->s, &u) < 0)
+			return fail(j, "invalid unicode escape");
+		j->s += 4;
+		if (u >= 0xD800 && u <= 0xDBFF) { /* a surrogate pair */
+			if (j->end - j->s < 6 || j->s[0] != '\\' || j->s[1] != 'u' || hex4(j->s + 2, &low) < 0 || low < 0xDC00 || low > 0xDFFF)
+				return fail(j, "invalid surrogate pair");
+			j->s += 6;
+			u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+		} else if (u >= 0xDC00 && u <= 0xDFFF) {
+			return fail(j, "invalid surrogate pair");
+		} else if (u == 0 && decode) { /* strings end at the first NUL */
+			return fail(j, "NUL not representable");
+		}
+		if (decode && utf8(&j->scratch, u) != PICKLE_OK)
+			return fail(j, "Out Of Memory");
+	}
+	if (decode && escaped) {
+		*s = j->scratch.buf ? j->scratch.buf : "";
+		*l = j->scratch.used;
+	} else {
+		*s = begin;
+		*l = j->s - begin;
+	}
+	j->s++; /* closing quote */
+	return PICKLE_OK;
+}
+
+static int digits(json_t *j) {
+	const char *s = j->s;
+	while (j->s < j->end && *j->s >= '0' && *j->s <= '9')
+		j->s++;
+	return j->s > s;
+}
+
+static int number(json_t *j) {
+	assert(j);
+	if (j->s < j->end && *j->s == '-')
+		j->s++;
+	if (j->s < j->end && *j->s == '0')
+		j->s++;
+	else if (!digits(j))
+		return fail(j, "invalid number");
+	if (j->s < j->end && *j->s == '.') {
+		j->s++;
+		if (!digits(j))
+			return fail(j, "invalid number");
+	}
+	if (j->s < j->end && (*j->s == 'e' || *j->s == 'E')) {
+		j->s++;
+		if (j->s < j->end && (*j->s == '+' || *j->s == '-'))
+			j->s++;
+		if (!digits(j))
+			return fail(j, "invalid number");
+	}
+	return PICKLE_OK;
+}
+
+static int literal(json_t *j, const char *word) {
+	assert(j);
+	const size_t l = strlen(word);
+	if ((size_t)(j->end - j->s) < l || memcmp(j->s, word, l))
+		return fail(j, "invalid value");
+	j->s += l;
+	return PICKLE_OK;
+}
+
+static int add(json_t *j, pickle_buffer_t *out, const char *s, size_t l, int bare) {
+	if (!out)
+		return PICKLE_OK;
+	if ((bare ? pickle_buffer_add(out, s, l) : pickle_buffer_element(out, s, l)) != PICKLE_OK)
+		return fail(j, "Out Of Memory");
+	return PICKLE_OK;
+}
+
+/* Parse a value, adding it to 'out' as a list element, or as it is if
+ * 'bare' is set and 'out' is empty, or just checking and skipping it if
+ * 'out' is NULL */
+static int value(json_t *j, pickle_buffer_t *out, int depth, int bare) {
+	assert(j);
+	ws(j);
+	if (j->s >= j->end)
+		return fail(j, "unexpected end");
+	const char *begin = j->s;
+	const char ch = *j->s;
+	if (ch == '"') {
+		const char *s = NULL;
+		size_t l = 0;
+		if (string(j, &s, &l, !!out) != PICKLE_OK)
+			return PICKLE_ERROR;
+		return add(j, out, s, l, bare);
+	}
+	if (ch == '-' || (ch >= '0' && ch <= '9')) {
+		if (number(j) != PICKLE_OK)
+			return PICKLE_ERROR;
+		return add(j, out, begin, j->s - begin, bare);
+	}
+	if (ch == 't' || ch == 'f' || ch == 'n') {
+		const char *word = ch == 't' ? "true" : ch == 'f' ? "false" : "null";
+		if (literal(j, word) != PICKLE_OK)
+			return PICKLE_ERROR;
+		return add(j, out, word, strlen(word), bare);
+	}
+	if (ch != '{' && ch != '[')
+		return fail(j, "invalid value");
+	if (depth >= JSON_DEPTH_MAX)
+		return fail(j, "nested too deeply");
+	pickle_buffer_t *list = out && bare ? out : out ? &j->levels[depth] : NULL;
+	const char close = ch == '{' ? '}' : ']';
+	if (list && list != out)
+		list->used = 0;
+	j->s++;
+	ws(j);
+	if (j->s < j->end && *j->s == close) {
+		j->s++;
+		return bare ? PICKLE_OK : add(j, out, "", 0, 0);
+	}
+	for (;;) {
+		if (ch == '{') {
+			const char *s = NULL;
+			size_t l = 0;
+			ws(j);
+			if (string(j, &s, &l, !!list) != PICKLE_OK || add(j, list, s, l, 0) != PICKLE_OK)
+				return PICKLE_ERROR;
+			ws(j);
+			if (j->s >= j->end || *j->s != ':')
+				return fail(j, "expected ':'");
+			j->s++;
+		}
+		if (value(j, list, depth + 1, 0) != PICKLE_OK)
+			return PICKLE_ERROR;
+		ws(j);
+		if (j->s < j->end && *j->s == ',') {
+			j->s++;
+			continue;
+		}
+		if (j->s < j->end && *j->s == close) {
+			j->s++;
+			break;
+		}
+		return fail(j, close == '}' ? "expected ',' or '}'" : "expected ',' or ']'");
+	}
+	if (!list || list == out)
+		return PICKLE_OK;
+	return add(j, out, list->buf ? list->buf : "", list->used, 0);
+}
+
+/* Parse a complete document, nothing but white space may follow it */
+static int document(json_t *j, pickle_buffer_t *out) {
+	assert(j);
+	if (value(j, out, 0, 1) != PICKLE_OK)
+		return PICKLE_ERROR;
+	ws(j);
+	return j->s == j->end ? PICKLE_OK : fail(j, "trailing characters");
+}
+
+/* Move the cursor to the value at the end of a path of object keys and
+ * array indices, skipping over everything else */
+static int find(json_t *j, int argc, char **argv) {
+	assert(j);
+	for (int k = 0; k < argc; k++) {
+		ws(j);
+		if (j->s >= j->end || (*j->s != '{' && *j->s != '['))
+			return fail(j, "path not found");
+		const int object = *j->s == '{';
+		long index = 0, n = 0;
+		if (!object) {
+			char *e = NULL;
+			index = strtol(argv[k], &e, 10);
+			if (!argv[k][0] || *e || index < 0)
+				return fail(j, "path not found");
+		}
+		j->s++;
+		ws(j);
+		if (j->s < j->end && *j->s == (object ? '}' : ']'))
+			return fail(j, "path not found");
+		for (int found = 0; !found; n++) {
+			if (object) {
+				const char *s = NULL;
+				size_t l = 0;
+				ws(j);
+				if (string(j, &s, &l, 1) != PICKLE_OK)
+					return PICKLE_ERROR;
+				found = l == strlen(argv[k]) && !memcmp(s, argv[k], l);
+				ws(j);
+				if (j->s >= j->end || *j->s != ':')
+					return fail(j, "expected ':'");
+				j->s++;
+			} else {
+				found = n == index;
+			}
+			if (found)
+				break;
+			if (value(j, NULL, k + 1, 0) != PICKLE_OK)
+				return PICKLE_ERROR;
+			ws(j);
+			if (j->s >= j->end || *j->s != ',')
+				return fail(j, "path not found");
+			j->s++;
+		}
+	}
+	ws(j);
+	return PICKLE_OK;
+}
+
+static int encodeString(pickle_buffer_t *b, const char *s) {
+	assert(b);
+	assert(s);
+	const char *end = s + strlen(s);
+	if (pickle_buffer_add(b, "\"", 1) != PICKLE_OK)
+		return PICKLE_ERROR;
+	for (;;) {
+		const char *p = scan(s, end);
+		if (p > s && pickle_buffer_add(b, s, p - s) != PICKLE_OK)
+			return PICKLE_ERROR;
+		if (p >= end)
+			break;
+		char e[8] = { '\\', *p, };
+		size_t l = 2;
+		switch (*p) {
+		case '"': case '\\': break;
+		case '\b': e[1] = 'b'; break;
+		case '\f': e[1] = 'f'; break;
+		case '\n': e[1] = 'n'; break;
+		case '\r': e[1] = 'r'; break;
+		case '\t': e[1] = 't'; break;
+		default: l = snprintf(e, sizeof e, "\\u%04x", (unsigned)(unsigned char)*p);
+		}
+		if (pickle_buffer_add(b, e, l) != PICKLE_OK)
+			return PICKLE_ERROR;
+		s = p + 1;
+	}
+	return pickle_buffer_add(b, "\"", 1);
+}
+
+/* Join JSON values (and for objects, encoded keys) into an array or object */
+static int encodeCompound(pickle_buffer_t *b, int argc, char **argv, int object) {
+	assert(b);
+	if (pickle_buffer_add(b, object ? "{" : "[", 1) != PICKLE_OK)
+		return PICKLE_ERROR;
+	for (int k = 0; k < argc; k++) {
+		const char *sep = k == 0 ? "" : object && (k % 2) ? ":" : ",";
+		if (pickle_buffer_add(b, sep, strlen(sep)) != PICKLE_OK)
+			return PICKLE_ERROR;
+		if (object && !(k % 2)) {
+			if (encodeString(b, argv[k]) != PICKLE_OK)
+				return PICKLE_ERROR;
+		} else if (pickle_buffer_add(b, argv[k], strlen(argv[k])) != PICKLE_OK) {
+			return PICKLE_ERROR;
+		}
+	}
+	return pickle_buffer_add(b, object ? "}" : "]", 1);
+}
+
+static int line(json_t *j, pickle_buffer_t *out, const char *s, size_t l, unsigned long n, const char *var, const char *body) {
+	assert(j);
+	jsonReset(j, s, l);
+	ws(j);
+	if (j->s == j->end) /* blank lines are allowed */
+		return PICKLE_OK;
+	out->used = 0;
+	if (document(j, out) != PICKLE_OK)
+		return error(j->i, "json: %s on line %lu", j->error ? j->error : "Out Of Memory", n);
+	if (pickle_var_set(j->i, var, out->buf ? out->buf : "") != PICKLE_OK)
+		return PICKLE_ERROR;
+	const int r = pickle_eval(j->i, body);
+	return r == PICKLE_CONTINUE ? PICKLE_OK : r;
+}
+
+/* Evaluate 'body' with 'var' set to each line of newline delimited JSON
+ * from a file, converted. The file is read in large chunks into a single
+ * buffer that only grows to fit the longest line. */
+static int lines(pickle_t *i, const char *path, const char *var, const char *body) {
+	errno = 0;
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return error(i, "Could not open file '%s' for reading: %s", path, strerror(errno));
+	json_t j;
+	pickle_buffer_t out = { .i = i };
+	jsonInit(&j, i, "", 0);
+	size_t size = JSON_CHUNK, used = 0;
+	unsigned long n = 0;
+	char *buf = pickle_allocate(i, size);
+	int r = buf ? PICKLE_OK : error(i, "Out Of Memory");
+	while (r == PICKLE_OK) {
+		size_t o = 0;
+		for (const char *nl = NULL; r == PICKLE_OK && (nl = memchr(buf + o, '\n', used - o)); o = (nl - buf) + 1)
+			r = line(&j, &out, buf + o, nl - (buf + o), ++n, var, body);
+		if (r != PICKLE_OK)
+			break;
+		memmove(buf, buf + o, used - o);
+		used -= o;
+		if (used == size) {
+			char *b = pickle_allocate(i, size * 2);
+			if (!b) {
+				r = error(i, "Out Of Memory");
+				break;
+			}
+			memcpy(b, buf, used);
+			(void)pickle_free(i, buf);
+			buf = b;
+			size *= 2;
+		}
+		const size_t got = fread(buf + used, 1, size - used, f);
+		if (!got) {
+			if (ferror(f))
+				r = error(i, "Could not read from file '%s'", path);
+			else if (used) /* no newline at the end */
+				r = line(&j, &out, buf, used, ++n, var, body);
+			break;
+		}
+		used += got;
+	}
+	if (r == PICKLE_BREAK)
+		r = PICKLE_OK;
+	(void)pickle_free(i, buf);
+	(void)pickle_buffer_free(&out);
+	(void)jsonFree(&j);
+	fclose(f);
+	return r == PICKLE_OK ? ok(i, "") : r;
+}
+
+static int pickleCommandJson(pickle_t *i, int argc, char **argv, void *pd) {
+	UNUSED(pd);
+	if (argc < 2)
+		return error(i, "Invalid command %s", argv[0]);
+	const char *sub = argv[1];
+	if (!strcmp(sub, "parse") || !strcmp(sub, "valid")) {
+		if (argc != 3)
+			return error(i, "Invalid subcommand %s: expected json", sub);
+		const int valid = sub[0] == 'v';
+		json_t j;
+		pickle_buffer_t out = { .i = i };
+		jsonInit(&j, i, argv[2], strlen(argv[2]));
+		int r = document(&j, valid ? NULL : &out);
+		if (valid)
+			r = ok(i, "%d", r == PICKLE_OK);
+		else
+			r = r == PICKLE_OK ? ok(i, "%s", out.buf ? out.buf : "") : jsonError(&j);
+		const int f1 = pickle_buffer_free(&out), f2 = jsonFree(&j);
+		return f1 == PICKLE_OK && f2 == PICKLE_OK ? r : PICKLE_ERROR;
+	}
+	if (!strcmp(sub, "get")) {
+		const int raw = argc > 2 && !strcmp(argv[2], "-json");
+		if (argc < 3 + raw)
+			return error(i, "Invalid subcommand %s: expected ?-json? json path...", sub);
+		json_t j;
+		pickle_buffer_t out = { .i = i };
+		jsonInit(&j, i, argv[2 + raw], strlen(argv[2 + raw]));
+		int r = find(&j, argc - 3 - raw, argv + 3 + raw);
+		const char *begin = j.s;
+		if (r == PICKLE_OK)
+			r = value(&j, raw ? NULL : &out, 0, 1);
+		if (r != PICKLE_OK)
+			r = jsonError(&j);
+		else if (raw)
+			r = ok(i, "%.*s", (int)(j.s - begin), begin);
+		else
+			r = ok(i, "%s", out.buf ? out.buf : "");
+		const int f1 = pickle_buffer_free(&out), f2 = jsonFree(&j);
+		return f1 == PICKLE_OK && f2 == PICKLE_OK ? r : PICKLE_ERROR;
+	}
+	if (!strcmp(sub, "lines")) {
+		if (argc != 5)
+			return error(i, "Invalid subcommand %s: expected file variable script", sub);
+		return lines(i, argv[2], argv[3], argv[4]);
+	}
+	if (!strcmp(sub, "string") || !strcmp(sub, "array") || !strcmp(sub, "object")) {
+		pickle_buffer_t out = { .i = i };
+		int r = PICKLE_OK;
+		if (sub[0] == 's') {
+			if (argc != 3)
+				return error(i, "Invalid subcommand %s: expected string", sub);
+			r = encodeString(&out, argv[2]);
+		} else {
+			const int object = sub[0] == 'o';
+			if (object && (argc % 2))
+				return error(i, "Invalid subcommand %s: expected ?key json...?", sub);
+			json_t j;
+			jsonInit(&j, i, "", 0);
+			for (int k = 2 + object; k < argc; k += 1 + object) {
+				jsonReset(&j, argv[k], strlen(argv[k]));
+				if (document(&j, NULL) != PICKLE_OK) {
+					(void)jsonFree(&j);
+					return error(i, "json: %s at offset %ld in value '%s'", j.error ? j.error : "Out Of Memory", (long)(j.s - j.start), argv[k]);
+				}
+			}
+			if (jsonFree(&j) != PICKLE_OK)
+				return PICKLE_ERROR;
+			r = encodeCompound(&out, argc - 2, argv + 2, object);
+		}
+		r = r == PICKLE_OK ? ok(i, "%s", out.buf) : error(i, "Out Of Memory");
+		return pickle_buffer_free(&out) == PICKLE_OK ? r : PICKLE_ERROR;
+	}
+	return error(i, "Invalid subcommand %s", sub);
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	UNUSED(m);
+	UNUSED(tag);
+	return PICKLE_OK;
+}
+
+int pickleModJsonRegister(pickle_mod_t *m) {
+	assert(m);
+	pickle_command_t cmds[] = {
+		{ "json", pickleCommandJson, m },
+	};
+	m->cleanup = cleanup;
+	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
+}
@@ -1,8 +1,17 @@
+#define _POSIX_C_SOURCE 200809L
 #include "mod.h"
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
 
 extern int pickleModCdbRegister(pickle_mod_t *m);
 extern int pickleModUtf8Register(pickle_mod_t *m);
@@ -10,6 +19,12 @@ extern int pickleModHttpcRegister(pickle_mod_t *m);
 extern int pickleModExprRegister(pickle_mod_t *m);
 extern int pickleModCRegister(pickle_mod_t *m);
 extern int pickleModSntpRegister(pickle_mod_t *m);
+extern int pickleModStatsRegister(pickle_mod_t *m);
+extern int pickleModThreadRegister(pickle_mod_t *m);
+extern int pickleModEventRegister(pickle_mod_t *m);
+extern int pickleModScreenRegister(pickle_mod_t *m);
+extern int pickleModJsonRegister(pickle_mod_t *m);
+extern int pickleModBase64Register(pickle_mod_t *m);
 
 #ifdef _WIN32 /* Used to unfuck file mode for "Win"dows. Text mode is for losers. */
 #include <windows.h>
@@ -81,12 +96,246 @@ int pickle_getopt(pickle_getopt_t *opt, const int argc, char *const argv[], cons
 	return opt->option; /* dump back option letter */
 }
 
+/* Every block handed out by 'pickle_mod_allocator' is preceded by a header
+ * recording its size and the account (the command that was running) it is
+ * charged to, so that the number of live bytes can be tracked and frees
+ * attributed.
+ *
+ * The slab allocator serves small blocks from per size class free lists,
+ * which are filled by carving up large pages with a bump pointer. Each
+ * interpreter has its own heap so no locking is needed. Large blocks are
+ * passed on to the system allocator. Pages are only returned to the
+ * system when the heap is destroyed. */
+
+typedef union {
+	struct {
+		size_t size;    /* requested size */
+		uint32_t class; /* slab size class, or SLAB_LARGE */
+		uint32_t owner; /* index into 'heap_t.accounts' */
+	} h;
+	long double align_ld;
+	void *align_p;
+	long long align_ll;
+} heap_header_t;
+
+#define SLAB_MIN (16ul)
+#define SLAB_LARGE (PICKLE_SLAB_CLASSES)
+
+static inline size_t slabClass(const size_t sz) {
+	size_t c = 0;
+	while (c < PICKLE_SLAB_CLASSES && (SLAB_MIN << c) < sz)
+		c++;
+	return c;
+}
+
+static heap_header_t *slabAllocate(slab_t *s, const size_t sz) {
+	assert(s);
+	const size_t c = slabClass(sz);
+	heap_header_t *b = NULL;
+	if (c == SLAB_LARGE) {
+		if (!(b = malloc(sizeof *b + sz)))
+			return NULL;
+	} else if (s->free[c]) {
+		b = s->free[c];
+		s->free[c] = *(void**)(b + 1);
+	} else {
+		const size_t bsz = sizeof *b + (SLAB_MIN << c);
+		if (!s->next || (size_t)(s->end - s->next) < bsz) {
+			char *page = malloc(PICKLE_SLAB_PAGE);
+			if (!page)
+				return NULL;
+			*(void**)page = s->pages; /* first block of a page links the pages together */
+			s->pages = page;
+			s->page_count++;
+			s->next = page + sizeof (heap_header_t);
+			s->end = page + PICKLE_SLAB_PAGE;
+		}
+		b = (heap_header_t*)s->next;
+		s->next += bsz;
+	}
+	b->h.class = c;
+	return b;
+}
+
+static void slabFree(slab_t *s, heap_header_t *b) {
+	assert(s);
+	assert(b);
+	const size_t c = b->h.class;
+	assert(c <= SLAB_LARGE);
+	if (c == SLAB_LARGE) {
+		free(b);
+		return;
+	}
+	*(void**)(b + 1) = s->free[c];
+	s->free[c] = b;
+}
+
+static heap_header_t *slabReallocate(slab_t *s, heap_header_t *b, const size_t sz) {
+	assert(s);
+	if (!b)
+		return slabAllocate(s, sz);
+	if (b->h.class == SLAB_LARGE)
+		return slabClass(sz) == SLAB_LARGE ? realloc(b, sizeof *b + sz) : b;
+	if (sz <= (SLAB_MIN << b->h.class))
+		return b;
+	heap_header_t *n = slabAllocate(s, sz);
+	if (!n)
+		return NULL;
+	memcpy(n + 1, b + 1, b->h.size);
+	slabFree(s, b);
+	return n;
+}
+
+static unsigned heapBucket(size_t sz) {
+	unsigned r = 0;
+	while (sz > 1 && r < (PICKLE_HEAP_HISTOGRAM - 1)) {
+		sz = (sz + 1) / 2;
+		r++;
+	}
+	return r;
+}
+
+heap_t *pickle_mod_heap(pickle_t *i) {
+	assert(i);
+	allocator_fn fn = NULL;
+	void *arena = NULL;
+	if (pickle_allocator_get(i, &fn, &arena) != PICKLE_OK)
+		return NULL;
+	return fn == pickle_mod_allocator ? arena : NULL;
+}
+
+int pickle_mod_heap_account(heap_t *h, const char *name, uint32_t parent, uint32_t *account) {
+	assert(h);
+	assert(name);
+	assert(account);
+	for (size_t j = 1; j < h->accounts_length; j++)
+		if (h->accounts[j].parent == parent && !strcmp(h->accounts[j].name, name)) {
+			*account = j;
+			return PICKLE_OK;
+		}
+	const size_t l = strlen(name);
+	char *n = malloc(l + 1);
+	const size_t length = MAX(h->accounts_length + 1, 2);
+	heap_account_t *as = realloc(h->accounts, length * sizeof *as);
+	if (!n || !as) {
+		free(n);
+		if (as)
+			h->accounts = as;
+		return PICKLE_ERROR;
+	}
+	if (!h->accounts_length) /* account zero is the interpreter itself */
+		as[h->accounts_length++] = (heap_account_t){ .name = NULL, };
+	as[h->accounts_length] = (heap_account_t){ .name = memcpy(n, name, l + 1), .parent = parent, };
+	*account = h->accounts_length++;
+	h->accounts = as;
+	return PICKLE_OK;
+}
+
+void pickle_mod_heap_destroy(heap_t *h) {
+	assert(h);
+	slab_t *s = &h->slab;
+	for (void *p = s->pages, *next = NULL; p; p = next) {
+		next = *(void**)p;
+		free(p);
+	}
+	memset(s->free, 0, sizeof s->free);
+	s->pages = NULL;
+	s->next = NULL;
+	s->end = NULL;
+	s->page_count = 0;
+	for (size_t j = 0; j < h->accounts_length; j++)
+		free((char*)h->accounts[j].name);
+	free(h->accounts);
+	h->accounts = NULL;
+	h->accounts_length = 0;
+	h->current = 0;
+}
+
+/* charge an account, and the module account it belongs to */
+static void heapCharge(heap_t *h, uint32_t account, long allocs, long bytes, long live) {
+	assert(h);
+	if (account >= h->accounts_length) /* no accounts have been made yet */
+		return;
+	heap_account_t *a = &h->accounts[account];
+	a->allocs += allocs;
+	a->bytes += bytes;
+	a->live += live;
+	if (a->parent) {
+		heap_account_t *p = &h->accounts[a->parent];
+		p->allocs += allocs;
+		p->bytes += bytes;
+		p->live += live;
+	}
+}
+
+/* Check that growing the heap by 'grow' bytes would not exceed the limit on
+ * the interpreter or the module of the running command. */
+static int heapQuota(heap_t *h, long grow) {
+	assert(h);
+	if (grow <= 0)
+		return PICKLE_OK;
+	if (h->limit && (h->live + grow) > h->limit) {
+		h->exceeded = -1;
+		return PICKLE_ERROR;
+	}
+	if (h->current >= h->accounts_length)
+		return PICKLE_OK;
+	const uint32_t m = h->accounts[h->current].parent;
+	if (m && h->accounts[m].limit && (h->accounts[m].live + grow) > h->accounts[m].limit) {
+		h->exceeded = m;
+		return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+static void heapFree(heap_t *h, void *ptr) {
+	assert(h);
+	if (!ptr)
+		return;
+	heap_header_t *b = ((heap_header_t*)ptr) - 1;
+	h->frees++;
+	h->live -= b->h.size;
+	heapCharge(h, b->h.owner, 0, 0, -(long)b->h.size);
+	if (h->slab.on)
+		slabFree(&h->slab, b);
+	else
+		free(b);
+}
+
+static void *heapReallocate(heap_t *h, void *ptr, const size_t sz) {
+	assert(h);
+	heap_header_t *b = ptr ? ((heap_header_t*)ptr) - 1 : NULL;
+	const size_t old = b ? b->h.size : 0;
+	const uint32_t owner = b ? b->h.owner : 0;
+	if (sz > ((size_t)-1) - sizeof *b)
+		return NULL;
+	if (heapQuota(h, (long)sz - (long)old) != PICKLE_OK)
+		return NULL;
+	heap_header_t *n = h->slab.on ? slabReallocate(&h->slab, b, sz) : realloc(b, sizeof *b + sz);
+	if (!n)
+		return NULL;
+	if (!h->slab.on)
+		n->h.class = SLAB_LARGE;
+	h->reallocs += !!ptr;
+	h->allocs++;
+	h->total += sz;
+	h->histogram[heapBucket(sz)]++;
+	if (b)
+		heapCharge(h, owner, 0, 0, -(long)old);
+	heapCharge(h, h->current, 1, sz, sz);
+	h->live += (long)sz - (long)old;
+	h->peak = MAX(h->peak, h->live);
+	n->h.size = sz;
+	n->h.owner = h->current;
+	return n + 1;
+}
+
 void *pickle_mod_allocator(void *arena, void *ptr, const size_t oldsz, const size_t newsz) {
 	assert(arena);
 	heap_t *h = arena;
 	/* assert(h && (h->frees <= h->allocs)); */
-	if (newsz == 0) { if (ptr) h->frees++; free(ptr); return NULL; }
-	if (newsz > oldsz) { h->reallocs += !!ptr; h->allocs++; h->total += newsz; return realloc(ptr, newsz); }
+	if (newsz == 0) { heapFree(h, ptr); return NULL; }
+	if (newsz > oldsz) { return heapReallocate(h, ptr, newsz); }
 	return ptr;
 }
 
@@ -118,34 +367,94 @@ void *pickle_allocate(pickle_t *i, size_t sz) {
 	return r ? memset(r, 0, sz) : NULL;
 }
 
+/* Size hint for reading the rest of a file in one go, zero if unknown */
+static size_t slurpHint(FILE *input) {
+	assert(input);
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(fileno(input), &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+	const long pos = ftell(input);
+	if (pos < 0 || (off_t)pos > st.st_size)
+		return 0;
+	return st.st_size - pos;
+#else
+	UNUSED(input);
+	return 0;
+#endif
+}
+
+/* Grow 'm' to hold at least 'need' bytes, to exactly that many if 'exact'
+ * is set and geometrically otherwise. 'pickle_realloc' frees 'm' on
+ * failure, it is set to NULL. */
+static int slurpGrow(pickle_t *i, char **m, size_t *size, size_t need, int exact) {
+	assert(m);
+	assert(size);
+	if (need <= *size)
+		return PICKLE_OK;
+	size_t sz = exact ? need : MAX(*size, 128);
+	while (sz < need)
+		sz *= 2;
+	char *n = pickle_realloc(i, *m, sz);
+	if (!n) {
+		*m = NULL;
+		return PICKLE_ERROR;
+	}
+	*m = n;
+	*size = sz;
+	return PICKLE_OK;
+}
+
+/* Read a whole file, or a line terminated by any of the characters in
+ * 'ch_class'. The buffer for a regular file is allocated at exactly its
+ * remaining size and read with a single call, it only grows (geometrically,
+ * like the buffers for streams of unknown size) if the file grew while
+ * being read. Lines ending in a newline are read with 'fgets' which scans
+ * the stdio buffer directly. */
 char *pickle_slurp(pickle_t *i, FILE *input, size_t *length, char *ch_class) {
+	assert(input);
 	char *m = NULL;
-	const size_t bsz = ch_class ? 4096 : 80;
-	size_t sz = 0;
+	size_t sz = 0, size = 0;
 	if (length)
 		*length = 0;
-	for (;;) {
-		if ((m = pickle_realloc(i, m, sz + bsz + 1)) == NULL)
+	if (!ch_class) {
+		if (slurpGrow(i, &m, &size, slurpHint(input) + 1, 1) != PICKLE_OK)
 			return NULL;
-		if (ch_class) {
-			size_t j = 0;
-			int ch = 0, done = 0;
-			for (; ((ch = fgetc(input)) != EOF) && j < bsz; ) {
-				m[sz + j++] = ch;
-				if (strchr(ch_class, ch)) {
-					done = 1;
-					break;
-				}
-			}
-			sz += j;
-			if (done || ch == EOF)
-				break;
-		} else {
-			size_t inc = fread(&m[sz], 1, bsz, input);
+		for (;;) {
+			const size_t want = size - sz - 1, inc = want ? fread(&m[sz], 1, want, input) : 0;
 			sz += inc;
-			if (inc != bsz)
+			if (inc != want)
+				break;
+			const int ch = getc(input); /* full, check for the end of file */
+			if (ch == EOF)
 				break;
+			if (slurpGrow(i, &m, &size, sz + 2, 0) != PICKLE_OK)
+				return NULL;
+			m[sz++] = ch;
 		}
+	} else if (ch_class[0] == '\n' && ch_class[1] == '\0') {
+		for (;;) {
+			if (slurpGrow(i, &m, &size, sz + 128, 0) != PICKLE_OK)
+				return NULL;
+			if (!fgets(&m[sz], size - sz, input))
+				break;
+			sz += strlen(&m[sz]);
+			if (sz && m[sz - 1] == '\n')
+				break;
+		}
+	} else {
+		unsigned char stop[256] = { 0 };
+		for (const char *c = ch_class; *c; c++)
+			stop[(unsigned char)*c] = 1;
+		for (int ch = 0; (ch = getc(input)) != EOF;) {
+			if (slurpGrow(i, &m, &size, sz + 2, 0) != PICKLE_OK)
+				return NULL;
+			m[sz++] = ch;
+			if (stop[(unsigned char)ch])
+				break;
+		}
+		if (slurpGrow(i, &m, &size, sz + 1, 0) != PICKLE_OK)
+			return NULL;
 	}
 	m[sz] = '\0'; /* ensure NUL termination */
 	if (length)
@@ -153,6 +462,138 @@ char *pickle_slurp(pickle_t *i, FILE *input, size_t *length, char *ch_class) {
 	return m;
 }
 
+/* Get the next element from a list, the element is not copied and has its
+ * surrounding braces or quotes removed, escape sequences are left as is. */
+int pickle_mod_list_next(const char **list, const char **element, size_t *length) {
+	assert(list);
+	assert(element);
+	assert(length);
+	const char *s = *list;
+	*element = NULL;
+	*length = 0;
+	while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')
+		s++;
+	if (!*s) {
+		*list = s;
+		return 0;
+	}
+	if (*s == '{') {
+		size_t depth = 1;
+		const char *start = ++s;
+		for (; *s && depth; s++) {
+			if (*s == '\\' && s[1]) {
+				s++;
+				continue;
+			}
+			depth += *s == '{';
+			depth -= *s == '}';
+		}
+		if (depth)
+			return -1;
+		*element = start;
+		*length = (s - start) - 1;
+	} else if (*s == '"') {
+		const char *start = ++s;
+		for (; *s && *s != '"'; s++)
+			if (*s == '\\' && s[1])
+				s++;
+		if (!*s)
+			return -1;
+		*element = start;
+		*length = s++ - start;
+	} else {
+		const char *start = s;
+		for (; *s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '\r'; s++)
+			if (*s == '\\' && s[1])
+				s++;
+		*element = start;
+		*length = s - start;
+	}
+	*list = s;
+	return 1;
+}
+
+int pickle_buffer_add(pickle_buffer_t *b, const char *s, size_t length) {
+	assert(b);
+	assert(b->i);
+	assert(s);
+	if ((b->used + length + 1) > b->size) {
+		size_t size = b->size ? b->size : 64;
+		while (size < (b->used + length + 1))
+			size *= 2;
+		char *buf = pickle_realloc(b->i, b->buf, size);
+		if (!buf) {
+			b->buf = NULL;
+			b->used = 0;
+			b->size = 0;
+			return PICKLE_ERROR;
+		}
+		b->buf = buf;
+		b->size = size;
+	}
+	memcpy(&b->buf[b->used], s, length);
+	b->used += length;
+	b->buf[b->used] = '\0';
+	return PICKLE_OK;
+}
+
+static int listSpecial(const char ch) {
+	return ch && strchr(" \t\n\r{}[]$;\"\\", ch);
+}
+
+/* Add a string to a buffer as a list element, quoting it if needed. */
+int pickle_buffer_element(pickle_buffer_t *b, const char *s, size_t length) {
+	assert(b);
+	assert(s);
+	if (b->used && pickle_buffer_add(b, " ", 1) != PICKLE_OK)
+		return PICKLE_ERROR;
+	if (!length)
+		return pickle_buffer_add(b, "{}", 2);
+	int special = 0, balanced = 1;
+	long depth = 0;
+	for (size_t j = 0; j < length; j++) {
+		const char ch = s[j];
+		if (listSpecial(ch))
+			special = 1;
+		if (ch == '\\')
+			balanced = 0;
+		depth += ch == '{';
+		depth -= ch == '}';
+		if (depth < 0)
+			balanced = 0;
+	}
+	if (!special)
+		return pickle_buffer_add(b, s, length);
+	if (balanced && !depth) {
+		if (pickle_buffer_add(b, "{", 1) != PICKLE_OK)
+			return PICKLE_ERROR;
+		if (pickle_buffer_add(b, s, length) != PICKLE_OK)
+			return PICKLE_ERROR;
+		return pickle_buffer_add(b, "}", 1);
+	}
+	for (size_t j = 0; j < length; j++) {
+		const char ch = s[j];
+		if (!listSpecial(ch)) {
+			if (pickle_buffer_add(b, &s[j], 1) != PICKLE_OK)
+				return PICKLE_ERROR;
+			continue;
+		}
+		const char e[2] = { '\\', ch == '\n' ? 'n' : ch == '\t' ? 't' : ch == '\r' ? 'r' : ch };
+		if (pickle_buffer_add(b, e, 2) != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+int pickle_buffer_free(pickle_buffer_t *b) {
+	assert(b);
+	const int r = pickle_free(b->i, b->buf);
+	b->buf = NULL;
+	b->used = 0;
+	b->size = 0;
+	return r;
+}
+
 static char *pickleStrdup(pickle_t *i, const char *s) {
 	assert(s);
 	assert(i);
@@ -161,12 +602,427 @@ static char *pickleStrdup(pickle_t *i, const char *s) {
 	return r ? memcpy(r, s, l + 1) : NULL;
 }
 
+/* Commands registered by modules are wrapped so that allocations made whilst
+ * they are running can be charged to them, and so they can be profiled. The
+ * wrapper makes one indirect call through 'call', which is switched (see
+ * 'pickleModDispatch') between waking the module up, profiling, charging
+ * allocations and calling the command directly, so none of these states
+ * has to be tested on each call. */
+struct pickle_mod_command;
+typedef int (*pickle_mod_call_t)(pickle_t *i, int argc, char **argv, struct pickle_mod_command *c);
+
+struct pickle_mod_command {
+	char *name;
+	pickle_func_t func;
+	void *privdata;
+	pickle_mod_t *m;
+	heap_t *heap;     /* NULL if the interpreter is not using 'pickle_mod_allocator' */
+	uint32_t account;
+	pickle_mod_call_t call;
+};
+
+/* Wall clock time in nanoseconds that never goes backwards */
+unsigned long long pickle_mod_clock(void) {
+#ifndef _WIN32
+	struct timespec t;
+	if (clock_gettime(CLOCK_MONOTONIC, &t) == 0)
+		return (t.tv_sec * 1000000000ull) + t.tv_nsec;
+#endif
+	return ((double)clock() / (double)CLOCKS_PER_SEC) * 1e9;
+}
+
+static int pickleCommandDirect(pickle_t *i, int argc, char **argv, struct pickle_mod_command *c) {
+	assert(c);
+	return c->func(i, argc, argv, c->privdata);
+}
+
+static int pickleCommandAccount(pickle_t *i, int argc, char **argv, struct pickle_mod_command *c) {
+	assert(c);
+	heap_t *h = c->heap;
+	assert(h);
+	const uint32_t current = h->current;
+	h->current = c->account;
+	h->exceeded = 0;
+	const int r = c->func(i, argc, argv, c->privdata);
+	h->current = current;
+	if (h->exceeded) { /* report which budget ran out, overriding any "Out Of Memory" message */
+		const long e = h->exceeded;
+		h->exceeded = 0;
+		if (e < 0)
+			return error(i, "Memory limit of %ld bytes exceeded in %s", h->limit, argv[0]);
+		return error(i, "Memory limit of %ld bytes exceeded by module '%s' in %s", h->accounts[e].limit, h->accounts[e].name, argv[0]);
+	}
+	return r;
+}
+
+static int pickleCommandCall(pickle_t *i, int argc, char **argv, struct pickle_mod_command *c) {
+	assert(c);
+	return c->heap ? pickleCommandAccount(i, argc, argv, c) : pickleCommandDirect(i, argc, argv, c);
+}
+
+/* The profiler keeps a trie of call stacks, each node is a command called
+ * from the stack of commands above it. Its memory comes from 'malloc' so
+ * that it does not show up in the interpreter's heap statistics.
+ *
+ * Only commands registered through 'pickle_mod_commands_register' are
+ * seen. The interpreter does not let its commands be wrapped, so its own
+ * commands, procedures defined with 'proc' and commands registered with
+ * 'pickle_command_register' directly are not profiled, and the time spent
+ * in them is charged to the module command that called them, or to no
+ * command at all when called from the top level. */
+typedef struct pickle_profile_node {
+	char *name;
+	unsigned long calls;
+	unsigned long long time; /* inclusive, in nanoseconds */
+	long allocs, bytes;      /* inclusive */
+	struct pickle_profile_node *parent, *child, *sibling;
+} pickle_profile_node_t;
+
+static pickle_profile_node_t *profileNode(pickle_profile_node_t *parent, const char *name) {
+	assert(name);
+	const size_t l = strlen(name);
+	pickle_profile_node_t *n = calloc(1, sizeof *n);
+	if (!n || !(n->name = malloc(l + 1))) {
+		free(n);
+		return NULL;
+	}
+	memcpy(n->name, name, l + 1);
+	n->parent = parent;
+	if (parent) {
+		n->sibling = parent->child;
+		parent->child = n;
+	}
+	return n;
+}
+
+static void profileFree(pickle_profile_node_t *n) {
+	while (n) {
+		pickle_profile_node_t *next = n->sibling;
+		profileFree(n->child);
+		free(n->name);
+		free(n);
+		n = next;
+	}
+}
+
+static pickle_profile_node_t *profileChild(pickle_profile_node_t *parent, const char *name) {
+	assert(parent);
+	assert(name);
+	for (pickle_profile_node_t *n = parent->child; n; n = n->sibling)
+		if (!strcmp(n->name, name))
+			return n;
+	return profileNode(parent, name);
+}
+
+static int profileCall(pickle_t *i, int argc, char **argv, struct pickle_mod_command *c) {
+	assert(c);
+	pickle_profile_t *p = &c->m->mods->profile;
+	pickle_profile_node_t *parent = p->current, *n = profileChild(parent, argv[0]);
+	if (!n) {
+		p->dropped++;
+		return pickleCommandCall(i, argc, argv, c);
+	}
+	heap_t *h = c->heap;
+	const long allocs = h ? h->allocs : 0, bytes = h ? h->total : 0;
+	p->current = n;
+	p->depth++;
+	const unsigned long long start = pickle_mod_clock();
+	const int r = pickleCommandCall(i, argc, argv, c);
+	n->time += pickle_mod_clock() - start;
+	n->calls++;
+	if (h) {
+		n->allocs += h->allocs - allocs;
+		n->bytes += h->total - bytes;
+	}
+	p->depth--;
+	p->current = parent;
+	return r;
+}
+
+static int pickleCommandWake(pickle_t *i, int argc, char **argv, struct pickle_mod_command *c);
+
+/* Pick how a command is called for the current state of its module and of
+ * the profiler, run whenever either changes. */
+static void pickleModDispatch(pickle_mod_t *m) {
+	assert(m);
+	const int on = m->mods && m->mods->profile.on;
+	for (size_t k = 0; k < m->commands_length; k++) {
+		struct pickle_mod_command *c = m->commands[k];
+		if (m->state != PICKLE_MOD_READY)
+			c->call = pickleCommandWake;
+		else if (on)
+			c->call = profileCall;
+		else
+			c->call = c->heap ? pickleCommandAccount : pickleCommandDirect;
+	}
+}
+
+static int pickleModInit(pickle_mod_t *m, heap_t *h, uint32_t account) {
+	assert(m);
+	assert(m->state == PICKLE_MOD_LAZY);
+	const uint32_t current = h ? h->current : 0;
+	if (h) /* charge the module's state to it */
+		h->current = account;
+	const int r = m->init ? m->init(m) : PICKLE_OK;
+	if (h)
+		h->current = current;
+	if (r != PICKLE_OK)
+		return PICKLE_ERROR;
+	m->state = PICKLE_MOD_READY;
+	pickleModDispatch(m);
+	return PICKLE_OK;
+}
+
+/* Modules are initialized on first use, so that interpreters which never
+ * call a module's commands do not pay for setting it up. */
+static int pickleCommandWake(pickle_t *i, int argc, char **argv, struct pickle_mod_command *c) {
+	assert(c);
+	pickle_mod_t *m = c->m;
+	if (m->state == PICKLE_MOD_UNLOADED)
+		return error(i, "Module '%s' is unloaded, cannot call %s", m->name, argv[0]);
+	if (pickleModInit(m, c->heap, c->account) != PICKLE_OK)
+		return error(i, "Could not initialize module '%s' for %s", m->name, argv[0]);
+	return c->call(i, argc, argv, c);
+}
+
+/* Initialize a module from C, for modules that use another's state before
+ * any of its commands have been called */
+int pickle_mod_ready(pickle_mod_t *m) {
+	assert(m);
+	if (m->state != PICKLE_MOD_LAZY)
+		return m->state == PICKLE_MOD_READY ? PICKLE_OK : PICKLE_ERROR;
+	heap_t *h = pickle_mod_heap(m->i);
+	uint32_t account = 0;
+	if (h && pickle_mod_heap_account(h, m->name, 0, &account) != PICKLE_OK)
+		return PICKLE_ERROR;
+	return pickleModInit(m, h, account);
+}
+
+static int pickleCommandWrapper(pickle_t *i, int argc, char **argv, void *pd) {
+	struct pickle_mod_command *c = pd;
+	return c->call(i, argc, argv, c);
+}
+
+static void profileSwitch(pickle_mods_t *ms, const int on) {
+	assert(ms);
+	ms->profile.on = on;
+	for (size_t j = 0; j < ms->length; j++)
+		pickleModDispatch(ms->mods[j]);
+}
+
+typedef struct {
+	const char *name;
+	unsigned long calls;
+	unsigned long long inclusive, exclusive;
+	long allocs, bytes; /* exclusive */
+} profile_entry_t;
+
+typedef struct {
+	profile_entry_t *entries;
+	size_t length, size;
+} profile_flat_t;
+
+/* Fold the trie into one entry per command, the inclusive time of recursive
+ * calls is only counted for the outermost call. */
+static int profileFlatten(profile_flat_t *f, pickle_profile_node_t *n) {
+	assert(f);
+	for (; n; n = n->sibling) {
+		unsigned long long children = 0;
+		long allocs = 0, bytes = 0;
+		for (pickle_profile_node_t *k = n->child; k; k = k->sibling) {
+			children += k->time;
+			allocs += k->allocs;
+			bytes += k->bytes;
+		}
+		profile_entry_t *e = NULL;
+		for (size_t j = 0; j < f->length && !e; j++)
+			if (!strcmp(f->entries[j].name, n->name))
+				e = &f->entries[j];
+		if (!e) {
+			if (f->length >= f->size) {
+				const size_t size = f->size ? f->size * 2 : 32;
+				profile_entry_t *es = realloc(f->entries, size * sizeof *es);
+				if (!es)
+					return PICKLE_ERROR;
+				f->entries = es;
+				f->size = size;
+			}
+			e = &f->entries[f->length++];
+			memset(e, 0, sizeof *e);
+			e->name = n->name;
+		}
+		int recursive = 0;
+		for (pickle_profile_node_t *a = n->parent; a && !recursive; a = a->parent)
+			recursive = !strcmp(a->name, n->name);
+		e->calls += n->calls;
+		e->inclusive += recursive ? 0 : n->time;
+		e->exclusive += n->time > children ? n->time - children : 0;
+		e->allocs += n->allocs - allocs;
+		e->bytes += n->bytes - bytes;
+		if (profileFlatten(f, n->child) != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+static int profileCompare(const void *a, const void *b) {
+	const profile_entry_t *x = a, *y = b;
+	return (x->exclusive < y->exclusive) - (x->exclusive > y->exclusive);
+}
+
+static unsigned long long profileElapsed(pickle_profile_t *p) {
+	assert(p);
+	return p->elapsed + (p->on ? pickle_mod_clock() - p->started : 0);
+}
+
+/* One command per line, most expensive first */
+static int profileReport(pickle_profile_t *p, pickle_buffer_t *b) {
+	assert(p);
+	assert(b);
+	profile_flat_t f = { .entries = NULL };
+	char line[512] = { 0 };
+	int r = PICKLE_ERROR;
+	if (p->root && profileFlatten(&f, p->root->child) != PICKLE_OK)
+		goto done;
+	if (f.length)
+		qsort(f.entries, f.length, sizeof *f.entries, profileCompare);
+	int l = snprintf(line, sizeof line, "elapsed %llu\ndropped %ld\n", profileElapsed(p), p->dropped);
+	if (l < 0 || pickle_buffer_add(b, line, l) != PICKLE_OK)
+		goto done;
+	for (size_t j = 0; j < f.length; j++) {
+		const profile_entry_t *e = &f.entries[j];
+		l = snprintf(line, sizeof line, "command %s calls %lu inclusive %llu exclusive %llu allocations %ld bytes %ld\n",
+				e->name, e->calls, e->inclusive, e->exclusive, e->allocs, e->bytes);
+		if (l < 0 || pickle_buffer_add(b, line, MIN((size_t)l, sizeof line - 1)) != PICKLE_OK)
+			goto done;
+	}
+	r = PICKLE_OK;
+done:
+	free(f.entries);
+	return r;
+}
+
+/* Folded stacks, "outer;inner;command self-time" per line, as consumed by
+ * 'flamegraph.pl' and similar tools. */
+static int profileFolded(FILE *out, pickle_profile_node_t *n, char **path, size_t *size, size_t used) {
+	assert(out);
+	assert(path);
+	assert(size);
+	for (; n; n = n->sibling) {
+		const size_t l = strlen(n->name), need = used + l + 2;
+		if (need > *size) {
+			char *np = realloc(*path, need * 2);
+			if (!np)
+				return PICKLE_ERROR;
+			*path = np;
+			*size = need * 2;
+		}
+		size_t u = used;
+		if (u)
+			(*path)[u++] = ';';
+		memcpy(&(*path)[u], n->name, l + 1);
+		u += l;
+		unsigned long long children = 0;
+		for (pickle_profile_node_t *k = n->child; k; k = k->sibling)
+			children += k->time;
+		if (n->time > children && fprintf(out, "%s %llu\n", *path, n->time - children) < 0)
+			return PICKLE_ERROR;
+		if (profileFolded(out, n->child, path, size, u) != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+static int pickleCommandProfile(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mods_t *ms = pd;
+	pickle_profile_t *p = &ms->profile;
+	if (argc < 2)
+		return error(i, "Invalid command %s: expected start|stop|report|dump file", argv[0]);
+	if (!strcmp(argv[1], "start")) {
+		if (argc != 2)
+			return error(i, "Invalid subcommand %s", argv[1]);
+		if (p->depth) /* nodes still in use by the commands we are called from */
+			return error(i, "Cannot start profiling from within a profiled command");
+		profileFree(p->root);
+		memset(p, 0, sizeof *p);
+		if (!(p->root = profileNode(NULL, "")))
+			return error(i, "Out Of Memory");
+		p->current = p->root;
+		p->started = pickle_mod_clock();
+		profileSwitch(ms, 1);
+		return PICKLE_OK;
+	}
+	if (!strcmp(argv[1], "stop")) {
+		if (argc != 2)
+			return error(i, "Invalid subcommand %s", argv[1]);
+		p->elapsed = profileElapsed(p);
+		profileSwitch(ms, 0);
+		return PICKLE_OK;
+	}
+	if (!strcmp(argv[1], "report")) {
+		if (argc != 2)
+			return error(i, "Invalid subcommand %s", argv[1]);
+		pickle_buffer_t b = { .i = i };
+		const int r = profileReport(p, &b) == PICKLE_OK ? ok(i, "%s", b.buf ? b.buf : "") : error(i, "Out Of Memory");
+		return pickle_buffer_free(&b) == PICKLE_OK ? r : PICKLE_ERROR;
+	}
+	if (!strcmp(argv[1], "dump")) {
+		if (argc != 3)
+			return error(i, "Invalid subcommand %s: expected file", argv[1]);
+		errno = 0;
+		FILE *f = fopen(argv[2], "wb");
+		if (!f)
+			return error(i, "Could not open file '%s' for writing: %s", argv[2], strerror(errno));
+		char *path = NULL;
+		size_t size = 0;
+		const int w = p->root ? profileFolded(f, p->root->child, &path, &size, 0) : PICKLE_OK;
+		free(path);
+		if (fclose(f) < 0 || w != PICKLE_OK)
+			return error(i, "Could not write to file '%s'", argv[2]);
+		return PICKLE_OK;
+	}
+	return error(i, "Invalid subcommand %s", argv[1]);
+}
+
 int pickle_mod_commands_register(pickle_mod_t *m, pickle_command_t *c, size_t length) {
 	assert(m);
 	assert(c);
-	for (size_t i = 0; i < length; i++)
-		if (pickle_command_register(m->i, c[i].name, c[i].func, c[i].privdata) != PICKLE_OK)
+	heap_t *h = pickle_mod_heap(m->i);
+	uint32_t module = 0;
+	if (h && m->name && pickle_mod_heap_account(h, m->name, 0, &module) != PICKLE_OK)
+		return PICKLE_ERROR;
+	for (size_t i = 0; i < length; i++) {
+		struct pickle_mod_command *w = pickle_allocate(m->i, sizeof *w);
+		if (!w)
 			return PICKLE_ERROR;
+		if (!(w->name = pickleStrdup(m->i, c[i].name))) {
+			(void)pickle_free(m->i, w);
+			return PICKLE_ERROR;
+		}
+		w->func = c[i].func;
+		w->privdata = c[i].privdata;
+		w->m = m;
+		w->heap = h;
+		w->call = pickleCommandWake;
+		if (h && pickle_mod_heap_account(h, c[i].name, module, &w->account) != PICKLE_OK) {
+			(void)pickle_free(m->i, w->name);
+			(void)pickle_free(m->i, w);
+			return PICKLE_ERROR;
+		}
+		struct pickle_mod_command **cs = pickle_realloc(m->i, m->commands, (m->commands_length + 1) * sizeof *cs);
+		if (!cs) {
+			m->commands = NULL;
+			m->commands_length = 0;
+			(void)pickle_free(m->i, w->name);
+			(void)pickle_free(m->i, w);
+			return PICKLE_ERROR;
+		}
+		m->commands = cs;
+		m->commands[m->commands_length++] = w;
+		pickleModDispatch(m);
+		if (pickle_command_register(m->i, c[i].name, pickleCommandWrapper, w) != PICKLE_OK)
+			return PICKLE_ERROR;
+	}
 	return PICKLE_OK;
 }
 
@@ -186,37 +1042,38 @@ int pickle_mod_tag_add(pickle_mod_t *m, const char *name, void *data) {
 	assert(name);
 	if (pickle_mod_tag_find(m, name))
 		return PICKLE_ERROR;
-	pickle_mod_tag_t *old = m->tags;
-	if ((m->tags = pickle_realloc(m->i, m->tags, m->length + 1 * sizeof (*m->tags))) == NULL) {
-		/* TODO: handle error */
-		(void)old;
+	char *n = pickleStrdup(m->i, name);
+	if (!n)
 		return PICKLE_ERROR;
-	}
-
-	pickle_mod_tag_t *t = &m->tags[m->length++];
-	if (!(t->name = pickleStrdup(m->i, name))) {
-		/* TODO: handle error */
+	/* not 'pickle_realloc', which would free the existing tags on failure */
+	pickle_mod_tag_t *tags = pickle_allocate(m->i, (m->length + 1) * sizeof (*m->tags));
+	if (!tags) {
+		(void)pickle_free(m->i, n);
 		return PICKLE_ERROR;
 	}
+	if (m->length)
+		memcpy(tags, m->tags, m->length * sizeof (*m->tags));
+	(void)pickle_free(m->i, m->tags);
+	m->tags = tags;
+	pickle_mod_tag_t *t = &m->tags[m->length++];
+	t->name = n;
 	t->tag = data;
 	return PICKLE_OK;
 }
 
 int pickle_mod_tag_remove(pickle_mod_t *m, const char *name) {
 	assert(m);
+	assert(name);
 	for (size_t i = 0; i < m->length; i++) {
 		pickle_mod_tag_t *t = &m->tags[i];
 		if (t->name && !strcmp(t->name, name)) {
-			if (t->tag)
-				m->cleanup(m, t->tag);
+			int r = PICKLE_OK;
+			if (t->tag && m->cleanup && m->cleanup(m, t->tag) != PICKLE_OK)
+				r = PICKLE_ERROR;
 			pickle_free(m->i, t->name);
-			t->tag = NULL;
-			t->name = NULL;
+			memmove(t, t + 1, (m->length - i - 1) * sizeof (*t));
 			m->length--;
-			//TODO: Sort out cleaning things up
-			//memmove();
-			//pickle_realloc();
-			return PICKLE_OK;
+			return r;
 		}
 	}
 	return PICKLE_ERROR;
@@ -241,69 +1098,231 @@ int pickle_mod_tag_foreach(pickle_mod_t *m, int (*fn)(pickle_mod_t *m, pickle_mo
 	return r;
 }
 
+pickle_mod_t *pickle_mod_find(pickle_mods_t *ms, const char *name) {
+	assert(ms);
+	assert(name);
+	for (size_t j = 0; j < ms->length; j++) {
+		pickle_mod_t *m = ms->mods[j];
+		if (m->state != PICKLE_MOD_UNLOADED && !strcmp(m->name, name))
+			return m;
+	}
+	return NULL;
+}
+
+static int pickleModTagsFree(pickle_mod_t *m) {
+	assert(m);
+	int r = PICKLE_OK;
+	if (m->state != PICKLE_MOD_UNLOADED) {
+		for (size_t k = 0; k < m->length; k++) {
+			if (m->cleanup && m->cleanup(m, m->tags[k].tag) != PICKLE_OK)
+				r = PICKLE_ERROR;
+			pickle_free(m->i, m->tags[k].name);
+		}
+	}
+	pickle_free(m->i, m->tags);
+	m->tags = NULL;
+	m->length = 0;
+	return r;
+}
+
+/* The module structure and its command wrappers are kept until the modules
+ * are destroyed, as are shared objects, as the unload may have been called
+ * from one of the module's own commands which is still executing. */
+static int pickleModUnload(pickle_mod_t *m) {
+	assert(m);
+	int r = pickleModTagsFree(m);
+	for (size_t k = 0; k < m->commands_length; k++)
+		if (pickle_command_rename(m->i, m->commands[k]->name, "") != PICKLE_OK)
+			r = PICKLE_ERROR;
+	m->state = PICKLE_MOD_UNLOADED;
+	pickleModDispatch(m);
+	return r;
+}
+
+static int pickleModAdd(pickle_mods_t *ms, pickle_mod_t *m) {
+	assert(ms);
+	assert(m);
+	/* not 'pickle_realloc', which would free the existing modules on failure */
+	pickle_mod_t **mods = pickle_allocate(ms->i, (ms->length + 1) * sizeof *mods);
+	if (!mods)
+		return PICKLE_ERROR;
+	memcpy(mods, ms->mods, ms->length * sizeof *mods);
+	(void)pickle_free(ms->i, ms->mods);
+	ms->mods = mods;
+	ms->mods[ms->length++] = m;
+	return PICKLE_OK;
+}
+
+/* Modules loaded at run time export 'pickleModRegister', which is called
+ * like the register functions of the built in modules. The module is named
+ * after the file, less any directory, "lib" prefix and extension. */
+static int pickleModLoad(pickle_t *i, pickle_mods_t *ms, const char *path) {
+	assert(ms);
+	assert(path);
+#ifndef _WIN32
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	if (!strncmp(base, "lib", 3) && base[3] && base[3] != '.')
+		base += 3;
+	char name[64] = { 0 };
+	const size_t l = strcspn(base, ".");
+	if (!l || l >= sizeof name)
+		return error(i, "Invalid module name %s", path);
+	memcpy(name, base, l);
+	if (pickle_mod_find(ms, name))
+		return error(i, "Module '%s' already loaded", name);
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
+		return error(i, "load '%s' failed: %s", path, dlerror());
+	pickle_mod_register_t reg = NULL;
+	*(void **)&reg = dlsym(handle, "pickleModRegister");
+	if (!reg) {
+		(void)dlclose(handle);
+		return error(i, "load '%s' failed: no pickleModRegister", path);
+	}
+	pickle_mod_t *m = pickle_allocate(i, sizeof *m);
+	char *n = pickleStrdup(i, name);
+	if (!m || !n || pickleModAdd(ms, m) != PICKLE_OK) {
+		(void)pickle_free(i, m);
+		(void)pickle_free(i, n);
+		(void)dlclose(handle);
+		return error(i, "Out Of Memory");
+	}
+	m->i = i;
+	m->mods = ms;
+	m->name = n;
+	m->handle = handle;
+	m->state = PICKLE_MOD_LAZY;
+	if (reg(m) != PICKLE_OK) {
+		(void)pickleModUnload(m);
+		return error(i, "load '%s' failed: module did not register", path);
+	}
+	return ok(i, "%s", name);
+#else
+	UNUSED(ms);
+	return error(i, "load '%s' failed: not implemented", path);
+#endif
+}
+
 static int pickleCommandModule(pickle_t *i, int argc, char **argv, void *pd) {
 	pickle_mods_t *ms = pd;
 	if (argc < 2)
-		return error(i, "Invalid command %s", argv[0]);
-	if (!strcmp("loaded", argv[1]))
-		return ok(i, "%lu", (unsigned long)ms->length);
+		return error(i, "Invalid command %s: expected loaded|list|load file|unload name", argv[0]);
+	const int count = !strcmp("loaded", argv[1]);
+	if (count || !strcmp("list", argv[1])) {
+		if (argc != 2)
+			return error(i, "Invalid subcommand %s", argv[1]);
+		pickle_buffer_t b = { .i = i };
+		unsigned long loaded = 0;
+		for (size_t j = 0; j < ms->length; j++) {
+			pickle_mod_t *m = ms->mods[j];
+			if (m->state == PICKLE_MOD_UNLOADED)
+				continue;
+			loaded++;
+			if (pickle_buffer_element(&b, m->name, strlen(m->name)) != PICKLE_OK) {
+				(void)pickle_buffer_free(&b);
+				return error(i, "Out Of Memory");
+			}
+		}
+		const int r = count ? ok(i, "%lu", loaded) : ok(i, "%s", b.buf ? b.buf : "");
+		return pickle_buffer_free(&b) == PICKLE_OK ? r : PICKLE_ERROR;
+	}
+	if (!strcmp("load", argv[1])) {
+		if (argc != 3)
+			return error(i, "Invalid subcommand %s: expected file", argv[1]);
+		return pickleModLoad(i, ms, argv[2]);
+	}
+	if (!strcmp("unload", argv[1])) {
+		if (argc != 3)
+			return error(i, "Invalid subcommand %s: expected name", argv[1]);
+		pickle_mod_t *m = pickle_mod_find(ms, argv[2]);
+		if (!m)
+			return error(i, "Invalid module %s", argv[2]);
+		return pickleModUnload(m) == PICKLE_OK ? PICKLE_OK : error(i, "unload '%s' failed", argv[2]);
+	}
 	return error(i, "Invalid subcommand %s", argv[1]);
 }
 
 pickle_mods_t *pickle_register_mods(pickle_t *i) {
 	assert(i);
 	struct reg {
+		const char *name;
 		int (*reg)(pickle_mod_t *m);
 	} regs[] = {
-		{ pickleModCdbRegister,   },
-		{ pickleModUtf8Register,  },
-		{ pickleModHttpcRegister, },
-		{ pickleModExprRegister,  },
-		{ pickleModCRegister,     },
-		{ pickleModSntpRegister,  },
+		{ "cdb",   pickleModCdbRegister,   },
+		{ "utf8",  pickleModUtf8Register,  },
+		{ "httpc", pickleModHttpcRegister, },
+		{ "expr",  pickleModExprRegister,  },
+		{ "c",     pickleModCRegister,     },
+		{ "sntp",  pickleModSntpRegister,  },
+		{ "stats", pickleModStatsRegister, },
+		{ "thread", pickleModThreadRegister, },
+		{ "event",  pickleModEventRegister,  },
+		{ "screen", pickleModScreenRegister, },
+		{ "json",   pickleModJsonRegister,   },
+		{ "base64", pickleModBase64Register, },
 	};
 	const size_t regsl = sizeof (regs) / sizeof(regs[0]);
 	pickle_mod_t *mods = pickle_allocate(i, regsl * sizeof *mods);
 	pickle_mods_t *ms = pickle_allocate(i, sizeof *ms);
+	pickle_mod_t **ptrs = pickle_allocate(i, regsl * sizeof *ptrs);
 
-	if (!ms || !mods) {
+	if (!ms || !mods || !ptrs) {
 		(void)pickle_free(i, mods);
 		(void)pickle_free(i, ms);
+		(void)pickle_free(i, ptrs);
 		return NULL;
 	}
 
-	if (pickle_command_register(i, "module", pickleCommandModule, ms) != PICKLE_OK) {
+	if (pickle_command_register(i, "module", pickleCommandModule, ms) != PICKLE_OK
+		|| pickle_command_register(i, "profile", pickleCommandProfile, ms) != PICKLE_OK) {
 		(void)pickle_free(i, mods);
 		(void)pickle_free(i, ms);
+		(void)pickle_free(i, ptrs);
 		return NULL;
 	}
 
-
+	/* Registering only sets up the commands, each module's 'init' is run
+	 * the first time one of its commands is called. */
 	for (size_t j = 0; j < regsl; j++) {
 		struct reg *r = &regs[j];
 		mods[j].i = i;
+		mods[j].mods = ms;
+		mods[j].name = r->name;
+		mods[j].state = PICKLE_MOD_LAZY;
+		ptrs[j] = &mods[j];
 		if (r->reg(&mods[j]) < 0) {
 		}
 	}
 	ms->length = regsl;
-	ms->mods = mods;
+	ms->mods = ptrs;
 	ms->i = i;
 	return ms;
 }
 
 void pickle_destroy_mods(pickle_mods_t *ms) {
 	assert(ms);
+	/* the built in modules come first, in one allocation */
+	pickle_mod_t *builtin = ms->length ? ms->mods[0] : NULL;
 	for (size_t j = 0; j < ms->length; j++) {
-		pickle_mod_t *m = &ms->mods[j];
-		//pickle_mod_tag_foreach(m, m->cleanup);
-		for (size_t k = 0; k < m->length; k++) {
-			m->cleanup(m, m->tags[k].tag);
-			pickle_free(m->i, m->tags[k].name);
+		pickle_mod_t *m = ms->mods[j];
+		(void)pickleModTagsFree(m);
+		for (size_t k = 0; k < m->commands_length; k++) {
+			pickle_free(ms->i, m->commands[k]->name);
+			pickle_free(ms->i, m->commands[k]);
+		}
+		pickle_free(ms->i, m->commands);
+		if (m->handle) {
+#ifndef _WIN32
+			(void)dlclose(m->handle);
+#endif
+			pickle_free(ms->i, (char*)m->name);
+			pickle_free(ms->i, m);
 		}
-		pickle_free(ms->i, m->tags);
 	}
+	profileFree(ms->profile.root);
+	pickle_free(ms->i, builtin);
 	pickle_free(ms->i, ms->mods);
 	pickle_free(ms->i, ms);
 	return;
 }
-
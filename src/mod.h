@@ -2,6 +2,7 @@
 #define MOD_H
 
 #include "pickle.h"
+#include <stdint.h>
 #include <stdio.h>
 
 typedef struct {
@@ -12,11 +13,27 @@ typedef struct {
 struct pickle_mod;
 typedef struct pickle_mod pickle_mod_t;
 
+struct pickle_mods;
+struct pickle_mod_command;
+
+enum {
+	PICKLE_MOD_LAZY,     /* commands registered, 'init' not yet run */
+	PICKLE_MOD_READY,
+	PICKLE_MOD_UNLOADED, /* tags cleaned up and commands removed */
+};
+
 struct pickle_mod {
 	pickle_t *i;
+	struct pickle_mods *mods; /* the set of modules this one belongs to */
+	const char *name;
 	pickle_mod_tag_t *tags;
 	size_t length;
+	int (*init)(pickle_mod_t *m); /* run on first use of one of the module's commands, may be NULL */
 	int (*cleanup)(pickle_mod_t *m, void *tag);
+	struct pickle_mod_command **commands; /* wrappers registered with the interpreter */
+	size_t commands_length;
+	int state;    /* PICKLE_MOD_LAZY, PICKLE_MOD_READY or PICKLE_MOD_UNLOADED */
+	void *handle; /* shared object for modules loaded at run time, NULL if built in */
 };
 
 typedef struct {
@@ -25,19 +42,64 @@ typedef struct {
 	void *privdata;
 } pickle_command_t;
 
+struct pickle_profile_node;
+
 typedef struct {
-	pickle_mod_t *mods;
+	struct pickle_profile_node *root, *current; /* trie of call stacks, allocated with 'malloc' */
+	unsigned long long started, elapsed;        /* nanoseconds */
+	long depth;                                 /* profiled commands currently executing */
+	long dropped;                               /* calls not recorded as a node could not be allocated */
+	int on;
+} pickle_profile_t;
+
+typedef struct pickle_mods {
+	pickle_mod_t **mods;
 	size_t length;
 	pickle_t *i;
+	pickle_profile_t profile;
 } pickle_mods_t;
 
+#define PICKLE_SLAB_CLASSES (8)           /* blocks of 16, 32, ..., 2048 bytes */
+#define PICKLE_SLAB_PAGE    (64ul * 1024ul) /* slab pages are carved up from chunks this big */
+
+typedef struct {
+	void *free[PICKLE_SLAB_CLASSES]; /* free list per size class */
+	char *next, *end;                /* bump allocation within the current page */
+	void *pages;                     /* all pages, released by 'pickle_mod_heap_destroy' */
+	long page_count;
+	int on;                          /* use the slab allocator for small blocks */
+} slab_t;
+
+#define PICKLE_HEAP_HISTOGRAM (32)         /* power of two size buckets */
+
+typedef struct {
+	const char *name;  /* command or module name, NULL for the interpreter itself */
+	long allocs, bytes, live;
+	long limit;        /* maximum live bytes for a module, zero for no limit */
+	uint32_t parent;   /* module account a command belongs to, zero for modules */
+} heap_account_t;    /* allocations charged to a command or module */
+
 typedef struct { 
 	long allocs, 
 	     frees, 
 	     reallocs, 
 	     total; 
+	long live, peak;                          /* bytes currently allocated, and most ever */
+	long limit;                               /* maximum live bytes, zero for no limit */
+	long exceeded;                            /* set when a limit is hit: -1 interpreter, else account */
+	long histogram[PICKLE_HEAP_HISTOGRAM];    /* allocations by size, bucket N is for <= 2^N */
+	heap_account_t *accounts;
+	size_t accounts_length;
+	uint32_t current;                         /* account of the command being executed */
+	slab_t slab;
 } heap_t;
 
+typedef struct {
+	pickle_t *i;
+	char *buf;   /* NUL terminated once something has been added */
+	size_t used, size;
+} pickle_buffer_t;   /* growable string, for building up results */
+
 typedef struct {
 	char *arg;   /* parsed argument */
 	int error,   /* turn error reporting on/off */
@@ -49,12 +111,21 @@ typedef struct {
 } pickle_getopt_t;   /* getopt clone; with a few modifications */
 
 typedef int (*pickle_mod_register_t)(pickle_mod_t *m);
+typedef int (*pickle_mod_event_t)(pickle_t *i, int fd, void *data); /* 'fd' is -1 for timers */
 
 void *pickle_mod_allocator(void *arena, void *ptr, const size_t oldsz, const size_t newsz);
+void pickle_mod_heap_destroy(heap_t *h);
+heap_t *pickle_mod_heap(pickle_t *i);
+int pickle_mod_heap_account(heap_t *h, const char *name, uint32_t parent, uint32_t *account);
+unsigned long long pickle_mod_clock(void);
 int pickle_free(pickle_t *i, void *ptr);
 void *pickle_allocate(pickle_t *i, size_t sz);
 void *pickle_realloc(pickle_t *i, void *ptr, size_t sz);
 char *pickle_slurp(pickle_t *i, FILE *input, size_t *length, char *ch_class);
+int pickle_mod_list_next(const char **list, const char **element, size_t *length);
+int pickle_buffer_add(pickle_buffer_t *b, const char *s, size_t length);
+int pickle_buffer_element(pickle_buffer_t *b, const char *s, size_t length);
+int pickle_buffer_free(pickle_buffer_t *b);
 
 int pickle_mod_commands_register(pickle_mod_t *m, pickle_command_t *c, size_t length);
 void *pickle_mod_tag_find(pickle_mod_t *m, const char *name);
@@ -65,6 +136,13 @@ pickle_mod_t *pickle_mod_new(pickle_t *i, pickle_mod_register_t rm);
 int pickle_mod_delete(pickle_t *i);
 
 pickle_mods_t *pickle_register_mods(pickle_t *i);
+pickle_mod_t *pickle_mod_find(pickle_mods_t *ms, const char *name);
+int pickle_mod_ready(pickle_mod_t *m);
+FILE *pickle_mod_channel(pickle_mods_t *ms, const char *name);
+int pickle_mod_event_forget(pickle_mods_t *ms, int fd);
+int pickle_mod_event_watch(pickle_mods_t *ms, int fd, pickle_mod_event_t fn, void *data);
+int pickle_mod_event_after(pickle_mods_t *ms, long ms_delay, pickle_mod_event_t fn, void *data, unsigned long *id);
+int pickle_mod_event_cancel(pickle_mods_t *ms, unsigned long id);
 void pickle_destroy_mods(pickle_mods_t *ms);
 
 int pickle_getopt(pickle_getopt_t *opt, const int argc, char *const argv[], const char *fmt);
@@ -0,0 +1,391 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mod.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+/* An off screen buffer of character cells for drawing to ANSI terminals.
+ * Scripts draw into the buffer with 'screen put' and 'screen flush' sends
+ * only the cells that differ from the last frame flushed, with the fewest
+ * cursor movements and attribute changes it can, in a single 'write'.
+ *
+ * Attributes are given as SGR parameters, the same as 'ansi sgr' in
+ * 'tcl/ansi.tcl', for example "1;31;44" or "38;5;208", and are packed into
+ * a single integer per cell. Each cell holds one UTF-8 encoded character,
+ * characters are assumed to be one column wide. */
+
+#define SCREEN_MAX       (1024)
+#define ATTR_COLOR_BITS  (9)   /* zero is the default, otherwise color + 1 */
+#define ATTR_COLOR_MASK  ((1u << ATTR_COLOR_BITS) - 1u)
+#define ATTR_FG(A)       ((A) & ATTR_COLOR_MASK)
+#define ATTR_BG(A)       (((A) >> ATTR_COLOR_BITS) & ATTR_COLOR_MASK)
+#define ATTR_FLAGS(A)    ((A) >> (2 * ATTR_COLOR_BITS))
+#define ATTR(FG, BG, F)  ((FG) | ((BG) << ATTR_COLOR_BITS) | ((F) << (2 * ATTR_COLOR_BITS)))
+#define ATTR_UNKNOWN     (UINT32_MAX) /* terminal state not known, never a valid attribute */
+
+typedef struct {
+	uint32_t attr;
+	char ch[4]; /* UTF-8, not NUL terminated if all four bytes are used */
+} cell_t;
+
+typedef struct {
+	int width, height;
+	cell_t *cells, *shown; /* frame being drawn, and the last one flushed */
+	int valid; /* is 'shown' what is on the terminal? */
+	pickle_buffer_t out; /* kept between flushes so it does not need regrowing */
+} screen_t;
+
+static const int flags[] = { 0, 1, 2, 3, 4, 5, 0, 7, }; /* SGR parameter for each flag bit, bit 0 unused */
+
+static int attributes(const char *s, uint32_t *attr) {
+	assert(s);
+	assert(attr);
+	unsigned fg = ATTR_FG(*attr), bg = ATTR_BG(*attr), f = ATTR_FLAGS(*attr);
+	long p[64] = { 0, };
+	size_t n = 0;
+	for (;;) { /* an empty parameter means zero, as on a terminal */
+		char *end = NULL;
+		if (n >= NELEMS(p))
+			return -1;
+		p[n++] = *s == ';' || !*s ? 0 : strtol(s, &end, 10);
+		if (end)
+			s = end;
+		if (!*s)
+			break;
+		if (*s++ != ';')
+			return -1;
+	}
+	for (size_t j = 0; j < n; j++) {
+		const long c = p[j];
+		if (c == 0) {
+			fg = bg = f = 0;
+		} else if (c >= 1 && c <= 7 && flags[c]) {
+			f |= 1u << c;
+		} else if (c == 22) {
+			f &= ~((1u << 1) | (1u << 2));
+		} else if (c >= 23 && c <= 27 && flags[c - 20]) {
+			f &= ~(1u << (c - 20));
+		} else if (c >= 30 && c <= 37) {
+			fg = c - 30 + 1;
+		} else if (c >= 90 && c <= 97) {
+			fg = c - 90 + 8 + 1;
+		} else if (c >= 40 && c <= 47) {
+			bg = c - 40 + 1;
+		} else if (c >= 100 && c <= 107) {
+			bg = c - 100 + 8 + 1;
+		} else if (c == 39) {
+			fg = 0;
+		} else if (c == 49) {
+			bg = 0;
+		} else if ((c == 38 || c == 48) && j + 2 < n && p[j + 1] == 5 && p[j + 2] >= 0 && p[j + 2] <= 255) {
+			*(c == 38 ? &fg : &bg) = p[j + 2] + 1;
+			j += 2;
+		} else {
+			return -1;
+		}
+	}
+	*attr = ATTR(fg, bg, f);
+	return 0;
+}
+
+static int sgrColor(char *s, size_t l, int base, unsigned color) {
+	assert(s);
+	if (!color)
+		return snprintf(s, l, ";%d", base + 9);
+	color--;
+	if (color < 8)
+		return snprintf(s, l, ";%u", base + color);
+	if (color < 16)
+		return snprintf(s, l, ";%u", base + 60 + color - 8);
+	return snprintf(s, l, ";%d;5;%u", base + 8, color);
+}
+
+/* Attributes are set from a reset, which is shorter than working out
+ * which ones need turning off, unless only the colors change */
+static int sgr(pickle_buffer_t *b, uint32_t from, uint32_t to) {
+	assert(b);
+	char s[64] = "\x1b[";
+	size_t l = 2;
+	if (from == ATTR_UNKNOWN || ATTR_FLAGS(from) != ATTR_FLAGS(to)) {
+		s[l++] = '0';
+		for (unsigned j = 1; j < NELEMS(flags); j++)
+			if (ATTR_FLAGS(to) & (1u << j))
+				l += snprintf(&s[l], sizeof s - l, ";%d", flags[j]);
+		if (ATTR_FG(to))
+			l += sgrColor(&s[l], sizeof s - l, 30, ATTR_FG(to));
+		if (ATTR_BG(to))
+			l += sgrColor(&s[l], sizeof s - l, 40, ATTR_BG(to));
+	} else {
+		if (ATTR_FG(from) != ATTR_FG(to))
+			l += sgrColor(&s[l], sizeof s - l, 30, ATTR_FG(to));
+		if (ATTR_BG(from) != ATTR_BG(to))
+			l += sgrColor(&s[l], sizeof s - l, 40, ATTR_BG(to));
+		memmove(&s[2], &s[3], l - 3); /* drop the leading ';' */
+		l--;
+	}
+	s[l++] = 'm';
+	return pickle_buffer_add(b, s, l);
+}
+
+/* Move from column 'cx' (or an unknown position if negative) to 'x' on
+ * row 'y', whichever of an absolute or relative move is shorter */
+static int move(pickle_buffer_t *b, int cx, int cy, int x, int y) {
+	assert(b);
+	char s[32];
+	int l = 0;
+	if (cy == y && cx >= 0 && x > cx)
+		l = x - cx == 1 ? snprintf(s, sizeof s, "\x1b[C") : snprintf(s, sizeof s, "\x1b[%dC", x - cx);
+	else if (x == 0)
+		l = snprintf(s, sizeof s, "\x1b[%dH", y + 1);
+	else
+		l = snprintf(s, sizeof s, "\x1b[%d;%dH", y + 1, x + 1);
+	return pickle_buffer_add(b, s, l);
+}
+
+static size_t cellLength(const cell_t *c) {
+	assert(c);
+	return c->ch[3] ? 4 : strlen(c->ch);
+}
+
+static int cellSame(const cell_t *a, const cell_t *b) {
+	return a->attr == b->attr && !memcmp(a->ch, b->ch, sizeof a->ch);
+}
+
+static void fill(screen_t *s, uint32_t attr) {
+	assert(s);
+	for (int j = 0; j < s->width * s->height; j++)
+		s->cells[j] = (cell_t){ .attr = attr, .ch = " ", };
+}
+
+static int resize(pickle_t *i, screen_t *s, int width, int height) {
+	assert(s);
+	cell_t *cells = pickle_allocate(i, 2 * width * height * sizeof *cells);
+	if (!cells)
+		return PICKLE_ERROR;
+	(void)pickle_free(i, s->cells);
+	s->cells  = cells;
+	s->shown  = cells + (width * height);
+	s->width  = width;
+	s->height = height;
+	s->valid  = 0;
+	fill(s, 0);
+	return PICKLE_OK;
+}
+
+/* Put UTF-8 text at x, y, returns the number of characters written. The
+ * text is clipped to the screen, control characters become spaces. */
+static int put(screen_t *s, int x, int y, const char *text, uint32_t attr) {
+	assert(s);
+	assert(text);
+	int n = 0;
+	if (y < 0 || y >= s->height)
+		return 0;
+	for (const unsigned char *t = (const unsigned char*)text; *t; x++) {
+		size_t l = *t < 0x80 ? 1 : *t >= 0xF0 ? 4 : *t >= 0xE0 ? 3 : *t >= 0xC0 ? 2 : 1;
+		for (size_t k = 1; k < l; k++)
+			if ((t[k] & 0xC0) != 0x80)
+				l = 1; /* invalid, take it a byte at a time */
+		if (x >= s->width)
+			break;
+		if (x >= 0) {
+			cell_t *c = &s->cells[(y * s->width) + x];
+			c->attr = attr;
+			memset(c->ch, 0, sizeof c->ch);
+			if (*t < 0x20 || *t == 0x7F)
+				c->ch[0] = ' ';
+			else
+				memcpy(c->ch, t, l);
+			n++;
+		}
+		t += l;
+	}
+	return n;
+}
+
+/* Over a short gap of unchanged cells it is cheaper to write the cells
+ * again than to move the cursor over them, if they need no SGR change */
+static int skip(screen_t *s, pickle_buffer_t *b, int cx, int cy, int x, int y, uint32_t attr) {
+	assert(s);
+	assert(b);
+	if (cy != y || cx < 0 || x < cx || x - cx > 3)
+		return move(b, cx, cy, x, y);
+	const cell_t *c = &s->cells[(y * s->width) + cx];
+	for (int j = 0; j < x - cx; j++)
+		if (c[j].attr != attr || cellLength(&c[j]) != 1)
+			return move(b, cx, cy, x, y);
+	for (int j = 0; j < x - cx; j++)
+		if (pickle_buffer_add(b, c[j].ch, 1) != PICKLE_OK)
+			return PICKLE_ERROR;
+	return PICKLE_OK;
+}
+
+static int flush(screen_t *s, pickle_buffer_t *b) {
+	assert(s);
+	assert(b);
+	int cx = -1, cy = -1;
+	uint32_t attr = ATTR_UNKNOWN; /* the script may have written its own */
+	b->used = 0;
+	for (int y = 0; y < s->height; y++) {
+		for (int x = 0; x < s->width; x++) {
+			const int k = (y * s->width) + x;
+			const cell_t *c = &s->cells[k];
+			if (s->valid && cellSame(c, &s->shown[k]))
+				continue;
+			if ((cx != x || cy != y) && skip(s, b, cx, cy, x, y, attr) != PICKLE_OK)
+				return PICKLE_ERROR;
+			if (attr != c->attr)
+				if (sgr(b, attr, c->attr) != PICKLE_OK)
+					return PICKLE_ERROR;
+			if (pickle_buffer_add(b, c->ch, cellLength(c)) != PICKLE_OK)
+				return PICKLE_ERROR;
+			attr = c->attr;
+			cx = x + 1;
+			cy = y;
+			if (cx >= s->width) /* terminals differ on wrapping, do not rely on it */
+				cx = cy = -1;
+		}
+	}
+	if (b->used && attr != 0 && sgr(b, ATTR_UNKNOWN, 0) != PICKLE_OK)
+		return PICKLE_ERROR;
+	memcpy(s->shown, s->cells, s->width * s->height * sizeof *s->cells);
+	s->valid = 1;
+	return PICKLE_OK;
+}
+
+static int number(pickle_t *i, const char *s, int *n) {
+	assert(s);
+	assert(n);
+	if (sscanf(s, "%d", n) != 1)
+		return error(i, "Invalid number %s", s);
+	return PICKLE_OK;
+}
+
+static int pickleCommandScreen(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mod_t *m = pd;
+	screen_t *s = pickle_mod_tag_find(m, "screen");
+	assert(s);
+	if (argc < 2)
+		return error(i, "Invalid command %s", argv[0]);
+	const char *sub = argv[1];
+	if (!strcmp(sub, "put")) {
+		int x = 0, y = 0;
+		uint32_t attr = 0;
+		if (argc != 5 && argc != 6)
+			return error(i, "Invalid subcommand %s: expected x y text ?attributes?", sub);
+		if (number(i, argv[2], &x) != PICKLE_OK || number(i, argv[3], &y) != PICKLE_OK)
+			return PICKLE_ERROR;
+		if (argc == 6 && attributes(argv[5], &attr) < 0)
+			return error(i, "Invalid attributes %s", argv[5]);
+		return ok(i, "%d", put(s, x, y, argv[4], attr));
+	}
+	if (!strcmp(sub, "clear")) {
+		uint32_t attr = 0;
+		if (argc != 2 && argc != 3)
+			return error(i, "Invalid subcommand %s: expected ?attributes?", sub);
+		if (argc == 3 && attributes(argv[2], &attr) < 0)
+			return error(i, "Invalid attributes %s", argv[2]);
+		fill(s, attr);
+		return ok(i, "");
+	}
+	if (!strcmp(sub, "size")) {
+		int width = 0, height = 0;
+		if (argc == 2)
+			return ok(i, "%d %d", s->width, s->height);
+		if (argc != 4)
+			return error(i, "Invalid subcommand %s: expected ?width height?", sub);
+		if (number(i, argv[2], &width) != PICKLE_OK || number(i, argv[3], &height) != PICKLE_OK)
+			return PICKLE_ERROR;
+		if (width < 1 || height < 1 || width > SCREEN_MAX || height > SCREEN_MAX)
+			return error(i, "Invalid size %d %d", width, height);
+		if (resize(i, s, width, height) != PICKLE_OK)
+			return error(i, "Out Of Memory");
+		return ok(i, "%d %d", width, height);
+	}
+	if (!strcmp(sub, "invalidate")) {
+		if (argc != 2)
+			return error(i, "Invalid subcommand %s", sub);
+		s->valid = 0;
+		return ok(i, "");
+	}
+	if (!strcmp(sub, "flush")) {
+		if (argc != 2 && argc != 3)
+			return error(i, "Invalid subcommand %s: expected ?channel?", sub);
+		FILE *f = pickle_mod_channel(m->mods, argc == 3 ? argv[2] : "stdout");
+		if (!f)
+			return error(i, "Invalid channel %s", argv[2]);
+		if (flush(s, &s->out) != PICKLE_OK)
+			return error(i, "Out Of Memory");
+		if (!s->out.used)
+			return ok(i, "0");
+		errno = 0;
+		if (fflush(f) < 0)
+			return error(i, "Write failed: %s", strerror(errno));
+#ifdef _WIN32
+		const int w = fwrite(s->out.buf, 1, s->out.used, f) != s->out.used || fflush(f) < 0;
+#else
+		int w = 0;
+		for (size_t done = 0; done < s->out.used && !w;) { /* normally one call */
+			const ssize_t n = write(fileno(f), s->out.buf + done, s->out.used - done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			w = n <= 0;
+			done += n > 0 ? n : 0;
+		}
+#endif
+		if (w) {
+			s->valid = 0; /* we do not know what made it to the terminal */
+			return error(i, "Write failed: %s", strerror(errno));
+		}
+		return ok(i, "%lu", (unsigned long)s->out.used);
+	}
+	return error(i, "Invalid subcommand %s", sub);
+}
+
+static int init(pickle_mod_t *m) {
+	assert(m);
+	screen_t *s = pickle_allocate(m->i, sizeof *s);
+	if (!s)
+		return PICKLE_ERROR;
+	memset(s, 0, sizeof *s);
+	s->out.i = m->i;
+	int width = 80, height = 24;
+#ifndef _WIN32
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row) {
+		width  = MIN(ws.ws_col, SCREEN_MAX);
+		height = MIN(ws.ws_row, SCREEN_MAX);
+	}
+#endif
+	if (resize(m->i, s, width, height) != PICKLE_OK || pickle_mod_tag_add(m, "screen", s) != PICKLE_OK) {
+		(void)pickle_free(m->i, s->cells);
+		(void)pickle_free(m->i, s);
+		return PICKLE_ERROR;
+	}
+	return PICKLE_OK;
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	assert(m);
+	screen_t *s = tag;
+	const int r1 = pickle_buffer_free(&s->out);
+	const int r2 = pickle_free(m->i, s->cells);
+	const int r3 = pickle_free(m->i, s);
+	return r1 == PICKLE_OK && r2 == PICKLE_OK && r3 == PICKLE_OK ? PICKLE_OK : PICKLE_ERROR;
+}
+
+int pickleModScreenRegister(pickle_mod_t *m) {
+	assert(m);
+	pickle_command_t cmds[] = {
+		{ "screen", pickleCommandScreen, m },
+	};
+	m->init = init;
+	m->cleanup = cleanup;
+	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
+}
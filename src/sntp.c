@@ -1,22 +1,433 @@
+#define _POSIX_C_SOURCE 200809L
 #include "mod.h"
 #ifndef _WIN32
 #include "sntp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 #endif
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 'sntp server ?port?' sends a single blocking query using the sntp
+ * library. 'sntp -servers {a b c}' instead queries every server at once
+ * over non-blocking UDP, drops replies whose offset is far from the rest,
+ * and caches the median offset against the monotonic clock so 'sntp now'
+ * can answer without any network traffic until the cache is older than
+ * the refresh interval. Adding '-command script' makes the query run in
+ * the background on the event loop, the command returns at once and the
+ * script is called with the result appended once every server has replied
+ * or the timeout expires, so many queries can be in flight at once whilst
+ * the interpreter waits in 'vwait'. Host name lookups still block. */
+
+#define SNTP_SERVERS_MAX  (16)
+#define SNTP_PACKET       (48)
+#define SNTP_EPOCH        (2208988800ull) /* seconds from 1900 to 1970 */
+#define SNTP_NS           (1000000000ll)
+
+enum { TAG_CACHE, TAG_QUERY, };
+
+typedef struct {
+	int type; /* TAG_CACHE */
+	char *servers; /* last servers queried, used to refresh the cache */
+	unsigned port;
+	long timeout, refresh; /* milliseconds, seconds */
+	long long base; /* Unix time in ns minus 'pickle_mod_clock' */
+	unsigned long long synced; /* 'pickle_mod_clock' when it was set */
+	int valid;
+} sntp_cache_t;
+
+#ifndef _WIN32
+
+typedef struct {
+	int fd;
+	unsigned char sent[8]; /* our transmit time stamp, echoed back */
+	long long t1;
+} sntp_query_t;
+
+typedef struct {
+	int type; /* TAG_QUERY */
+	pickle_mod_t *m;
+	char name[32]; /* of the tag it is kept under until it finishes */
+	sntp_query_t qs[SNTP_SERVERS_MAX];
+	long long offsets[SNTP_SERVERS_MAX], delays[SNTP_SERVERS_MAX];
+	size_t n, replies, waiting;
+	unsigned long timer; /* time out, if 'timing' */
+	int timing;
+	char *script;
+} sntp_async_t;
+
+static long long realtime(void) {
+	struct timespec ts = { 0, 0 };
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	return (ts.tv_sec * SNTP_NS) + ts.tv_nsec;
+}
+
+static void stamp(unsigned char *b, long long ns) {
+	assert(b);
+	const unsigned long long s = (ns / SNTP_NS) + SNTP_EPOCH;
+	const unsigned long long f = ((unsigned long long)(ns % SNTP_NS) << 32) / SNTP_NS;
+	for (int j = 0; j < 4; j++) {
+		b[j]     = (s >> (24 - (8 * j))) & 0xFF;
+		b[j + 4] = (f >> (24 - (8 * j))) & 0xFF;
+	}
+}
+
+static long long unstamp(const unsigned char *b) {
+	assert(b);
+	unsigned long long s = 0, f = 0;
+	for (int j = 0; j < 4; j++) {
+		s = (s << 8) | b[j];
+		f = (f << 8) | b[j + 4];
+	}
+	return ((long long)(s - SNTP_EPOCH) * SNTP_NS) + (long long)((f * SNTP_NS) >> 32);
+}
+
+static int sntpOpen(sntp_query_t *q, const char *server, unsigned port) {
+	assert(q);
+	assert(server);
+	char service[16] = { 0 };
+	snprintf(service, sizeof service, "%u", port);
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM, }, *res = NULL;
+	if (getaddrinfo(server, service, &hints, &res) != 0)
+		return -1;
+	q->fd = -1;
+	for (struct addrinfo *a = res; a && q->fd < 0; a = a->ai_next) {
+		if ((q->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+			continue;
+		const int status = fcntl(q->fd, F_GETFL), flags = fcntl(q->fd, F_GETFD); /* SOCK_NONBLOCK and SOCK_CLOEXEC are not portable */
+		if (status < 0 || flags < 0 || fcntl(q->fd, F_SETFL, status | O_NONBLOCK) < 0 || fcntl(q->fd, F_SETFD, flags | FD_CLOEXEC) < 0
+				|| connect(q->fd, a->ai_addr, a->ai_addrlen) < 0) { /* only accept replies from the server */
+			(void)close(q->fd);
+			q->fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (q->fd < 0)
+		return -1;
+	unsigned char p[SNTP_PACKET] = { 0x23, }; /* no leap warning, version 4, client */
+	q->t1 = realtime();
+	stamp(&p[40], q->t1);
+	memcpy(q->sent, &p[40], sizeof q->sent);
+	if (send(q->fd, p, sizeof p, 0) != (ssize_t)sizeof p) {
+		(void)close(q->fd);
+		q->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Read a reply, returns 0 and the offset and delay in ns if it is valid */
+static int sntpRead(sntp_query_t *q, long long *offset, long long *delay) {
+	assert(q);
+	unsigned char p[SNTP_PACKET] = { 0, };
+	const ssize_t n = recv(q->fd, p, sizeof p, 0);
+	const long long t4 = realtime();
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 1;
+	if (n != (ssize_t)sizeof p)
+		return -1;
+	const int leap = p[0] >> 6, mode = p[0] & 7, stratum = p[1];
+	if (leap == 3 || mode != 4 || stratum < 1 || stratum > 15 || memcmp(&p[24], q->sent, sizeof q->sent))
+		return -1;
+	const long long t2 = unstamp(&p[32]), t3 = unstamp(&p[40]);
+	*offset = ((t2 - q->t1) + (t3 - t4)) / 2;
+	*delay  = (t4 - q->t1) - (t3 - t2);
+	return 0;
+}
+
+static int compare(const void *a, const void *b) {
+	const long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+static long long median(long long *v, size_t n) {
+	assert(v);
+	assert(n);
+	qsort(v, n, sizeof *v, compare);
+	return n % 2 ? v[n / 2] : (v[(n / 2) - 1] + v[n / 2]) / 2;
+}
+
+/* Send a query to every server in a white space separated list, returns
+ * the number sent */
+static size_t sntpStart(sntp_query_t *qs, const char *servers, unsigned port) {
+	assert(qs);
+	assert(servers);
+	size_t n = 0;
+	for (const char *s = servers; *s && n < SNTP_SERVERS_MAX;) {
+		const size_t skip = strspn(s, " \t\r\n"), l = strcspn(s + skip, " \t\r\n");
+		char name[256] = { 0 };
+		if (!l || l >= sizeof name)
+			break;
+		memcpy(name, s + skip, l);
+		s += skip + l;
+		if (sntpOpen(&qs[n], name, port) == 0)
+			n++;
+	}
+	return n;
+}
+
+/* Combine the replies, returns the number used */
+static int sntpSummary(long long *offsets, long long *delays, size_t replies, long long *offset, long long *delay) {
+	assert(offsets);
+	assert(delays);
+	if (!replies)
+		return 0;
+	/* discard offsets more than three median absolute deviations from the
+	 * median, a falseticker should not be able to drag the result */
+	long long sorted[SNTP_SERVERS_MAX];
+	memcpy(sorted, offsets, replies * sizeof *sorted);
+	const long long m = median(sorted, replies);
+	for (size_t j = 0; j < replies; j++)
+		sorted[j] = llabs(offsets[j] - m);
+	const long long mad = MAX(median(sorted, replies), 1000000ll); /* 1ms floor */
+	size_t kept = 0;
+	for (size_t j = 0; j < replies; j++) {
+		if (llabs(offsets[j] - m) > 3 * mad)
+			continue;
+		offsets[kept] = offsets[j];
+		delays[kept] = delays[j];
+		kept++;
+	}
+	*offset = median(offsets, kept);
+	*delay = median(delays, kept);
+	return kept;
+}
+
+/* Query all servers in a white space separated list at once, returns the
+ * number of replies used */
+static int sntpQuery(const char *servers, unsigned port, long timeout, long long *offset, long long *delay) {
+	assert(servers);
+	sntp_query_t qs[SNTP_SERVERS_MAX];
+	struct pollfd fds[SNTP_SERVERS_MAX];
+	long long offsets[SNTP_SERVERS_MAX], delays[SNTP_SERVERS_MAX];
+	const size_t n = sntpStart(qs, servers, port);
+	size_t replies = 0, waiting = n;
+	for (size_t j = 0; j < n; j++)
+		fds[j] = (struct pollfd){ .fd = qs[j].fd, .events = POLLIN, };
+	const unsigned long long deadline = pickle_mod_clock() + (timeout * 1000000ull);
+	while (waiting) {
+		const unsigned long long now = pickle_mod_clock();
+		if (now >= deadline)
+			break;
+		const int r = poll(fds, n, (int)((deadline - now + 999999ull) / 1000000ull));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		for (size_t j = 0; j < n; j++) {
+			if (fds[j].fd < 0 || !fds[j].revents)
+				continue;
+			const int got = sntpRead(&qs[j], &offsets[replies], &delays[replies]);
+			if (got > 0)
+				continue;
+			replies += got == 0;
+			fds[j].fd = -1; /* poll ignores negative descriptors */
+			waiting--;
+		}
+	}
+	for (size_t j = 0; j < n; j++)
+		(void)close(qs[j].fd);
+	return sntpSummary(offsets, delays, replies, offset, delay);
+}
+
+static void sntpSet(sntp_cache_t *c, long long offset) {
+	assert(c);
+	c->synced = pickle_mod_clock();
+	c->base = realtime() + offset - (long long)c->synced;
+	c->valid = 1;
+}
+
+static int sntpRefresh(pickle_t *i, sntp_cache_t *c) {
+	assert(c);
+	assert(c->servers);
+	long long offset = 0, d = 0;
+	const int n = sntpQuery(c->servers, c->port, c->timeout, &offset, &d);
+	if (n <= 0)
+		return error(i, "sntp: no replies from %s", c->servers);
+	sntpSet(c, offset);
+	return ok(i, "{offset %lld} {delay %lld} {servers %d}", offset, d, n);
+}
+
+/* Stop listening for replies to a query */
+static void asyncClose(sntp_async_t *a, size_t j) {
+	assert(a);
+	if (a->qs[j].fd < 0)
+		return;
+	(void)pickle_mod_event_forget(a->m->mods, a->qs[j].fd);
+	(void)close(a->qs[j].fd);
+	a->qs[j].fd = -1;
+}
+
+static int asyncFree(pickle_mod_t *m, sntp_async_t *a) {
+	assert(m);
+	assert(a);
+	for (size_t j = 0; j < a->n; j++)
+		asyncClose(a, j);
+	if (a->timing)
+		(void)pickle_mod_event_cancel(m->mods, a->timer);
+	const int r = pickle_free(m->i, a->script);
+	return pickle_free(m->i, a) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+/* Update the cache and call the script with the result, which is the same
+ * as the blocking form's or '{servers 0}' if nothing replied in time */
+static int asyncFinish(pickle_t *i, sntp_async_t *a) {
+	assert(a);
+	pickle_mod_t *m = a->m;
+	long long offset = 0, d = 0;
+	const int n = sntpSummary(a->offsets, a->delays, a->replies, &offset, &d);
+	char result[96] = { 0 };
+	if (n > 0) {
+		sntp_cache_t *c = pickle_mod_tag_find(m, "cache");
+		assert(c);
+		sntpSet(c, offset);
+		snprintf(result, sizeof result, "{offset %lld} {delay %lld} {servers %d}", offset, d, n);
+	} else {
+		snprintf(result, sizeof result, "{servers 0}");
+	}
+	pickle_buffer_t b = { .i = i };
+	const int built = pickle_buffer_add(&b, a->script, strlen(a->script)) == PICKLE_OK
+		&& pickle_buffer_element(&b, result, strlen(result)) == PICKLE_OK;
+	if (pickle_mod_tag_remove(m, a->name) != PICKLE_OK || !built) {
+		(void)pickle_buffer_free(&b);
+		return error(i, "sntp: could not finish query");
+	}
+	const int r = pickle_eval(i, b.buf);
+	return pickle_buffer_free(&b) == PICKLE_OK ? r : PICKLE_ERROR;
+}
+
+static int asyncReadable(pickle_t *i, int fd, void *data) {
+	sntp_async_t *a = data;
+	assert(a);
+	size_t j = 0;
+	while (j < a->n && a->qs[j].fd != fd)
+		j++;
+	assert(j < a->n);
+	const int got = sntpRead(&a->qs[j], &a->offsets[a->replies], &a->delays[a->replies]);
+	if (got > 0)
+		return PICKLE_OK;
+	a->replies += got == 0;
+	asyncClose(a, j);
+	return --a->waiting ? PICKLE_OK : asyncFinish(i, a);
+}
+
+static int asyncTimeout(pickle_t *i, int fd, void *data) {
+	UNUSED(fd);
+	sntp_async_t *a = data;
+	assert(a);
+	a->timing = 0; /* the loop has already removed the timer */
+	return asyncFinish(i, a);
+}
+
+static int sntpAsync(pickle_t *i, pickle_mod_t *m, sntp_cache_t *c, const char *script) {
+	assert(m);
+	assert(c);
+	assert(script);
+	sntp_async_t *a = pickle_allocate(i, sizeof *a);
+	if (!a)
+		return error(i, "Out Of Memory");
+	const size_t l = strlen(script);
+	*a = (sntp_async_t){ .type = TAG_QUERY, .m = m, .script = pickle_allocate(i, l + 1), };
+	snprintf(a->name, sizeof a->name, "query %p", (void*)a);
+	if (!a->script) {
+		(void)pickle_free(i, a);
+		return error(i, "Out Of Memory");
+	}
+	memcpy(a->script, script, l + 1);
+	a->waiting = a->n = sntpStart(a->qs, c->servers, c->port);
+	int r = pickle_mod_tag_add(m, a->name, a);
+	if (r != PICKLE_OK) {
+		(void)asyncFree(m, a);
+		return error(i, "Out Of Memory");
+	}
+	for (size_t j = 0; r == PICKLE_OK && j < a->n; j++)
+		r = pickle_mod_event_watch(m->mods, a->qs[j].fd, asyncReadable, a);
+	if (r == PICKLE_OK)
+		r = pickle_mod_event_after(m->mods, c->timeout, asyncTimeout, a, &a->timer);
+	if (r != PICKLE_OK) {
+		(void)pickle_mod_tag_remove(m, a->name);
+		return error(i, "sntp: could not add query to the event loop");
+	}
+	a->timing = 1;
+	return ok(i, "");
+}
+
+#endif
 
 static int pickleCommandSntp(pickle_t *i, int argc, char **argv, void *pd) {
-	UNUSED(pd);
+	pickle_mod_t *m = pd;
+	if (argc < 2)
+		return error(i, "Invalid command %s", argv[0]);
+#ifdef _WIN32
+	UNUSED(m);
+	return error(i, "not implemented");
+#else
+	sntp_cache_t *c = pickle_mod_tag_find(m, "cache");
+	assert(c);
+	if (argc == 2 && !strcmp(argv[1], "now")) {
+		const unsigned long long now = pickle_mod_clock();
+		if (!c->valid || !c->servers)
+			return error(i, "sntp: no servers queried");
+		if ((now - c->synced) / 1000000000ull >= (unsigned long long)c->refresh)
+			if (sntpRefresh(i, c) != PICKLE_OK)
+				return PICKLE_ERROR;
+		const long long t = (long long)pickle_mod_clock() + c->base;
+		const unsigned long seconds = t / SNTP_NS;
+		const unsigned long fractional = ((unsigned long long)(t % SNTP_NS) << 32) / SNTP_NS;
+		return ok(i, "%lu %lu", seconds, fractional);
+	}
+	if (argv[1][0] == '-') {
+		const char *servers = NULL, *script = NULL;
+		long port = 123, timeout = 1000, interval = 1024;
+		int j = 1;
+		for (; j + 1 < argc; j += 2) {
+			long *v = NULL;
+			if (!strcmp(argv[j], "-servers")) {
+				servers = argv[j + 1];
+				continue;
+			}
+			if (!strcmp(argv[j], "-command")) {
+				script = argv[j + 1];
+				continue;
+			}
+			if (!strcmp(argv[j], "-port"))
+				v = &port;
+			else if (!strcmp(argv[j], "-timeout"))
+				v = &timeout;
+			else if (!strcmp(argv[j], "-refresh"))
+				v = &interval;
+			if (!v || sscanf(argv[j + 1], "%ld", v) != 1)
+				break;
+		}
+		if (j != argc || !servers || port < 1 || port > 65535 || timeout < 1 || interval < 0)
+			return error(i, "Invalid command %s: expected -servers {list} ?-port N? ?-timeout ms? ?-refresh s? ?-command script?", argv[0]);
+		const size_t l = strlen(servers);
+		char *s = pickle_allocate(i, l + 1);
+		if (!s)
+			return error(i, "Out Of Memory");
+		memcpy(s, servers, l + 1);
+		(void)pickle_free(i, c->servers);
+		c->servers = s;
+		c->port = port;
+		c->timeout = timeout;
+		c->refresh = interval;
+		c->valid = 0;
+		return script ? sntpAsync(i, m, c, script) : sntpRefresh(i, c);
+	}
 	if (argc != 2 && argc != 3)
 		return error(i, "Invalid command %s", argv[0]);
-
 	unsigned port = 123;
 	if (argc == 3) {
-		if (scanf(argv[2], "%u", &port) != 1)
-		       return error(i, "Invalid number %s", argv[2]);	
+		if (sscanf(argv[2], "%u", &port) != 1)
+			return error(i, "Invalid number %s", argv[2]);
 	}
-#ifdef _WIN32
-	return error(i, "not implemented");
-#else
 	unsigned long seconds = 0, fractional = 0;
 	const int r = sntp(argv[1], port, &seconds, &fractional);
 	if (r < 0)
@@ -25,18 +436,38 @@ static int pickleCommandSntp(pickle_t *i, int argc, char **argv, void *pd) {
 #endif
 }
 
-static int cleanup(pickle_mod_t *m, void *tag) {
-	UNUSED(m);
-	UNUSED(tag);
+static int init(pickle_mod_t *m) {
+	assert(m);
+	sntp_cache_t *c = pickle_allocate(m->i, sizeof *c);
+	if (!c)
+		return PICKLE_ERROR;
+	memset(c, 0, sizeof *c);
+	c->type = TAG_CACHE;
+	if (pickle_mod_tag_add(m, "cache", c) != PICKLE_OK) {
+		(void)pickle_free(m->i, c);
+		return PICKLE_ERROR;
+	}
 	return PICKLE_OK;
-}	
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	assert(m);
+	assert(tag);
+#ifndef _WIN32
+	if (*(int*)tag == TAG_QUERY)
+		return asyncFree(m, tag);
+#endif
+	sntp_cache_t *c = tag;
+	const int r = pickle_free(m->i, c->servers);
+	return pickle_free(m->i, c) == PICKLE_OK ? r : PICKLE_ERROR;
+}
 
 int pickleModSntpRegister(pickle_mod_t *m) {
 	assert(m);
-	pickle_command_t cmds[] = { 
-		{ "sntp",  pickleCommandSntp,  m }, 
+	pickle_command_t cmds[] = {
+		{ "sntp",  pickleCommandSntp,  m },
 	};
+	m->init = init;
 	m->cleanup = cleanup;
 	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
 }
-
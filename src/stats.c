@@ -0,0 +1,283 @@
+#include "mod.h"
+#include "q.h"
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Aggregate functions over lists of fixed point numbers, the aggregates
+ * are computed in a single pass in C instead of calling 'expr' for each
+ * element of a list in a script. Intermediate results are kept in wider
+ * types so that overflow can be detected and reported, results that do
+ * not fit in a 'q_t' are saturated. */
+
+typedef struct {
+	q_t *values;
+	size_t length, size;
+	q_t min, max;
+	ld_t sum;      /* sum of raw values */
+	ld_t mean;     /* running mean, with QBITS extra fractional bits */
+	ld_t m2;       /* sum of squared differences from the mean, raw units squared */
+	int saturated; /* a result did not fit in a 'q_t' */
+	int overflow;  /* 'm2' overflowed */
+} stats_t;
+
+static q_t saturate(stats_t *s, ld_t v) {
+	assert(s);
+	if (v > qinfo.max) {
+		s->saturated = 1;
+		return qinfo.max;
+	}
+	if (v < qinfo.min) {
+		s->saturated = 1;
+		return qinfo.min;
+	}
+	return v;
+}
+
+static ld_t labs64(ld_t v) {
+	return v < 0 ? -v : v;
+}
+
+/* Welford's online algorithm for the variance */
+static void welford(stats_t *s, q_t x) {
+	assert(s);
+	const ld_t n = s->length;
+	const ld_t xs = (ld_t)x * ((ld_t)1 << QBITS);
+	const ld_t delta = xs - s->mean;
+	s->mean += delta / n;
+	const ld_t a = delta / ((ld_t)1 << QBITS), b = (xs - s->mean) / ((ld_t)1 << QBITS);
+	if (s->overflow)
+		return;
+	if ((a && labs64(b) > INT64_MAX / labs64(a)) || s->m2 > INT64_MAX - (a * b)) {
+		s->overflow = 1;
+		return;
+	}
+	const ld_t p = a * b;
+	s->m2 += p;
+}
+
+static int add(pickle_t *i, stats_t *s, q_t x) {
+	assert(s);
+	if (s->length >= s->size) {
+		const size_t size = s->size ? s->size * 2 : 64;
+		q_t *values = pickle_realloc(i, s->values, size * sizeof *values);
+		if (!values) {
+			s->values = NULL;
+			return PICKLE_ERROR;
+		}
+		s->values = values;
+		s->size = size;
+	}
+	s->values[s->length++] = x;
+	s->min = s->length == 1 ? x : MIN(s->min, x);
+	s->max = s->length == 1 ? x : MAX(s->max, x);
+	s->sum += x;
+	welford(s, x);
+	return PICKLE_OK;
+}
+
+static int parse(pickle_t *i, stats_t *s, const char *list) {
+	assert(i);
+	assert(s);
+	assert(list);
+	char n[64];
+	const char *e = NULL, *next = list;
+	size_t l = 0;
+	int r = 0;
+	while ((r = pickle_mod_list_next(&next, &e, &l)) > 0) {
+		if (l >= sizeof n)
+			return error(i, "Invalid number %.*s", (int)MIN(l, sizeof n), e);
+		memcpy(n, e, l);
+		n[l] = '\0';
+		q_t x = 0;
+		if (qconv(&x, n) < 0)
+			return error(i, "Invalid number %s", n);
+		if (add(i, s, x) != PICKLE_OK)
+			return error(i, "Out Of Memory");
+	}
+	if (r < 0)
+		return error(i, "Invalid list %s", list);
+	return PICKLE_OK;
+}
+
+static void swap(q_t *a, q_t *b) {
+	const q_t t = *a;
+	*a = *b;
+	*b = t;
+}
+
+/* Quickselect, reorders 'v' so that 'v[k]' is in its sorted position */
+static q_t selection(q_t *v, size_t length, size_t k) {
+	assert(v);
+	assert(k < length);
+	size_t lo = 0, hi = length - 1;
+	while (lo < hi) {
+		swap(&v[lo + ((hi - lo) / 2)], &v[hi]);
+		const q_t pivot = v[hi];
+		size_t store = lo;
+		for (size_t j = lo; j < hi; j++)
+			if (v[j] < pivot)
+				swap(&v[j], &v[store++]);
+		swap(&v[store], &v[hi]);
+		if (store == k)
+			break;
+		if (k < store)
+			hi = store - 1;
+		else
+			lo = store + 1;
+	}
+	return v[k];
+}
+
+static q_t percentile(stats_t *s, q_t p) {
+	assert(s);
+	assert(s->length);
+	const ld_t hundred = (ld_t)100 << QBITS;
+	const ld_t rank = (((ld_t)p * (ld_t)s->length) + hundred - 1) / hundred; /* nearest rank */
+	const size_t k = rank > 0 ? (size_t)rank - 1 : 0;
+	return selection(s->values, s->length, MIN(k, s->length - 1));
+}
+
+static q_t mean(stats_t *s) {
+	assert(s);
+	return s->length ? saturate(s, s->sum / (ld_t)s->length) : 0;
+}
+
+static q_t variance(stats_t *s) {
+	assert(s);
+	if (s->length < 2)
+		return 0;
+	if (s->overflow)
+		return saturate(s, INT64_MAX);
+	return saturate(s, (s->m2 / (ld_t)(s->length - 1)) / ((ld_t)1 << QBITS));
+}
+
+static int result(pickle_t *i, stats_t *s, int strict, const char *name, q_t v) {
+	assert(s);
+	if (strict && s->saturated)
+		return error(i, "Overflow in %s", name);
+	char n[64] = { 0 };
+	if (qsprint(v, n, sizeof n) < 0)
+		return error(i, "Numeric conversion failed in %s", name);
+	return ok(i, "%s", n);
+}
+
+static int histogram(pickle_t *i, stats_t *s, long buckets) {
+	assert(s);
+	if (buckets <= 0 || buckets > 4096)
+		return error(i, "Invalid number of buckets %ld", buckets);
+	unsigned long *counts = pickle_allocate(i, buckets * sizeof *counts);
+	char *r = pickle_allocate(i, (buckets * 24) + 1);
+	if (!counts || !r) {
+		(void)pickle_free(i, counts);
+		(void)pickle_free(i, r);
+		return error(i, "Out Of Memory");
+	}
+	const ld_t range = (ld_t)s->max - (ld_t)s->min + 1;
+	for (size_t j = 0; j < s->length; j++)
+		counts[(((ld_t)s->values[j] - s->min) * buckets) / range]++;
+	size_t used = 0;
+	for (long j = 0; j < buckets; j++)
+		used += sprintf(&r[used], j ? " %lu" : "%lu", counts[j]);
+	const int rv = ok(i, "%s", r);
+	(void)pickle_free(i, counts);
+	(void)pickle_free(i, r);
+	return rv;
+}
+
+static int all(pickle_t *i, stats_t *s, int strict) {
+	assert(s);
+	const q_t vs[] = { saturate(s, s->sum), mean(s), s->min, s->max, variance(s), 0, percentile(s, qint(50)), };
+	char n[NELEMS(vs)][64];
+	if (strict && s->saturated)
+		return error(i, "Overflow in stats");
+	for (size_t j = 0; j < NELEMS(vs); j++) {
+		q_t v = vs[j];
+		if (j == 5) /* standard deviation */
+			v = s->overflow ? qinfo.max : qsqrt(vs[4]);
+		if (qsprint(v, n[j], sizeof n[j]) < 0)
+			return error(i, "Numeric conversion failed in stats");
+	}
+	return ok(i, "{count %lu} {sum %s} {mean %s} {min %s} {max %s} {variance %s} {stddev %s} {median %s} {saturated %d}",
+			(unsigned long)s->length, n[0], n[1], n[2], n[3], n[4], n[5], n[6], !!(s->saturated));
+}
+
+static int pickleCommandStats(pickle_t *i, int argc, char **argv, void *pd) {
+	UNUSED(pd);
+	const char *usage = "Invalid command %s: stats ?-strict? {count|sum|mean|min|max|variance|stddev|median|percentile|histogram|all} arg? list";
+	int strict = 0;
+	if (argc > 1 && !strcmp(argv[1], "-strict")) {
+		strict = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 3 && argc != 4)
+		return error(i, usage, argv[0]);
+	const char *cmd = argv[1];
+	const int extra = !strcmp(cmd, "percentile") || !strcmp(cmd, "histogram");
+	if (extra != (argc == 4))
+		return error(i, usage, argv[0]);
+	stats_t s = { .values = NULL };
+	int r = parse(i, &s, argv[argc - 1]);
+	if (r != PICKLE_OK)
+		goto done;
+	r = PICKLE_ERROR;
+	if (!strcmp(cmd, "count")) {
+		r = ok(i, "%lu", (unsigned long)s.length);
+		goto done;
+	}
+	if (!s.length) {
+		r = error(i, "Empty list given to %s", cmd);
+		goto done;
+	}
+	if (!strcmp(cmd, "sum"))
+		r = result(i, &s, strict, cmd, saturate(&s, s.sum));
+	else if (!strcmp(cmd, "mean"))
+		r = result(i, &s, strict, cmd, mean(&s));
+	else if (!strcmp(cmd, "min"))
+		r = result(i, &s, strict, cmd, s.min);
+	else if (!strcmp(cmd, "max"))
+		r = result(i, &s, strict, cmd, s.max);
+	else if (!strcmp(cmd, "variance"))
+		r = result(i, &s, strict, cmd, variance(&s));
+	else if (!strcmp(cmd, "stddev")) {
+		const q_t v = variance(&s);
+		r = result(i, &s, strict, cmd, s.overflow ? qinfo.max : qsqrt(v));
+	} else if (!strcmp(cmd, "median"))
+		r = result(i, &s, strict, cmd, percentile(&s, qint(50)));
+	else if (!strcmp(cmd, "percentile")) {
+		q_t p = 0;
+		if (qconv(&p, argv[2]) < 0 || p < 0 || p > qint(100))
+			r = error(i, "Invalid percentile %s", argv[2]);
+		else
+			r = result(i, &s, strict, cmd, percentile(&s, p));
+	} else if (!strcmp(cmd, "histogram")) {
+		long buckets = 0;
+		if (sscanf(argv[2], "%ld", &buckets) != 1)
+			r = error(i, "Invalid number %s", argv[2]);
+		else
+			r = histogram(i, &s, buckets);
+	} else if (!strcmp(cmd, "all"))
+		r = all(i, &s, strict);
+	else
+		r = error(i, "Invalid subcommand %s", cmd);
+done:
+	(void)pickle_free(i, s.values);
+	return r;
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	UNUSED(m);
+	UNUSED(tag);
+	return PICKLE_OK;
+}
+
+int pickleModStatsRegister(pickle_mod_t *m) {
+	assert(m);
+	pickle_command_t cmds[] = {
+		{ "stats",  pickleCommandStats,  m },
+	};
+	m->cleanup = cleanup;
+	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
+}
@@ -0,0 +1,404 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mod.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+/* A pool of worker threads, each with its own interpreter and heap so that
+ * evaluating scripts needs no locks. Jobs are handed to workers through
+ * bounded lock free queues, one per worker, and idle workers steal from
+ * the queues of busy ones. Everything shared between threads is allocated
+ * with 'malloc' as the interpreter allocators are not thread safe. Only
+ * the thread that created a pool may use it.
+ *
+ * Calling 'exit' from a worker exits the whole process. */
+
+#define THREAD_QUEUE (1024) /* jobs per worker queue, must be a power of two */
+#define THREAD_MAX   (256)
+#define CACHE_LINE   (64)
+
+#ifndef _WIN32
+
+typedef struct {
+	size_t sequence;
+	void *data;
+} cell_t;
+
+/* Dmitry Vyukov's bounded multi producer, multi consumer queue */
+typedef struct {
+	cell_t *cells;
+	size_t mask;
+	char pad0[CACHE_LINE];
+	size_t enqueue;
+	char pad1[CACHE_LINE];
+	size_t dequeue;
+	char pad2[CACHE_LINE];
+} queue_t;
+
+typedef struct {
+	unsigned long id;
+	char *script, *result;
+	int status;
+	sem_t done;
+} job_t;
+
+struct pool;
+
+typedef struct {
+	pthread_t thread;
+	struct pool *pool;
+	size_t id;
+	queue_t queue;
+	heap_t heap;
+	pickle_t *i;
+	pickle_mods_t *ms;
+	int started;
+} worker_t;
+
+typedef struct pool {
+	char name[32];
+	worker_t *workers;
+	size_t length;
+	sem_t work;     /* posted once per job, and once per worker to stop */
+	int stop;
+	size_t next;    /* worker to hand the next job to */
+	job_t **jobs;   /* outstanding jobs, only used by the creating thread */
+	size_t jobs_length, jobs_size;
+	unsigned long ids;
+} pool_t;
+
+static int queueInit(queue_t *q, size_t size) {
+	assert(q);
+	assert(size && !(size & (size - 1)));
+	if (!(q->cells = malloc(size * sizeof *q->cells)))
+		return PICKLE_ERROR;
+	for (size_t j = 0; j < size; j++)
+		__atomic_store_n(&q->cells[j].sequence, j, __ATOMIC_RELAXED);
+	q->mask = size - 1;
+	__atomic_store_n(&q->enqueue, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->dequeue, 0, __ATOMIC_RELAXED);
+	return PICKLE_OK;
+}
+
+static int queuePush(queue_t *q, void *data) {
+	assert(q);
+	cell_t *cell = NULL;
+	size_t pos = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		const size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		const intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->enqueue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return PICKLE_ERROR; /* full */
+		} else {
+			pos = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+		}
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return PICKLE_OK;
+}
+
+static void *queuePop(queue_t *q) {
+	assert(q);
+	cell_t *cell = NULL;
+	size_t pos = __atomic_load_n(&q->dequeue, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &q->cells[pos & q->mask];
+		const size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		const intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->dequeue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL; /* empty */
+		} else {
+			pos = __atomic_load_n(&q->dequeue, __ATOMIC_RELAXED);
+		}
+	}
+	void *data = cell->data;
+	__atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+	return data;
+}
+
+static char *duplicate(const char *s) {
+	assert(s);
+	const size_t l = strlen(s);
+	char *r = malloc(l + 1);
+	return r ? memcpy(r, s, l + 1) : NULL;
+}
+
+static void jobFree(job_t *j) {
+	if (!j)
+		return;
+	(void)sem_destroy(&j->done);
+	free(j->script);
+	free(j->result);
+	free(j);
+}
+
+static void jobRun(worker_t *w, job_t *j) {
+	assert(w);
+	assert(j);
+	const char *result = NULL;
+	j->status = pickle_eval(w->i, j->script);
+	if (pickle_result_get(w->i, &result) != PICKLE_OK || !result)
+		result = "";
+	if (!(j->result = duplicate(result)))
+		j->status = PICKLE_ERROR;
+	(void)sem_post(&j->done);
+}
+
+/* Take a job from our own queue, or else steal one from another worker */
+static job_t *jobTake(worker_t *w) {
+	assert(w);
+	pool_t *p = w->pool;
+	for (size_t k = 0; k < p->length; k++) {
+		job_t *j = queuePop(&p->workers[(w->id + k) % p->length].queue);
+		if (j)
+			return j;
+	}
+	return NULL;
+}
+
+static void *worker(void *arg) {
+	worker_t *w = arg;
+	pool_t *p = w->pool;
+	for (;;) {
+		while (sem_wait(&p->work) < 0)
+			;
+		job_t *j = jobTake(w);
+		if (j) {
+			jobRun(w, j);
+			continue;
+		}
+		if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+	return NULL;
+}
+
+static int workerInit(pool_t *p, worker_t *w, size_t id, int slab) {
+	assert(p);
+	assert(w);
+	w->pool = p;
+	w->id = id;
+	w->heap.slab.on = slab;
+	if (queueInit(&w->queue, THREAD_QUEUE) != PICKLE_OK)
+		return PICKLE_ERROR;
+	if (pickle_new(&w->i, pickle_mod_allocator, &w->heap) != PICKLE_OK)
+		return PICKLE_ERROR;
+	if (!(w->ms = pickle_register_mods(w->i)))
+		return PICKLE_ERROR;
+	if (pthread_create(&w->thread, NULL, worker, w) != 0)
+		return PICKLE_ERROR;
+	w->started = 1;
+	return PICKLE_OK;
+}
+
+static void workerFree(worker_t *w) {
+	assert(w);
+	if (w->ms)
+		pickle_destroy_mods(w->ms);
+	if (w->i)
+		(void)pickle_delete(w->i);
+	pickle_mod_heap_destroy(&w->heap);
+	free(w->queue.cells);
+}
+
+/* Finishes all outstanding jobs before stopping the workers */
+static int poolFree(pool_t *p) {
+	if (!p)
+		return PICKLE_OK;
+	int r = PICKLE_OK;
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	for (size_t k = 0; k < p->length; k++)
+		if (p->workers[k].started)
+			(void)sem_post(&p->work);
+	for (size_t k = 0; k < p->length; k++)
+		if (p->workers[k].started && pthread_join(p->workers[k].thread, NULL) != 0)
+			r = PICKLE_ERROR;
+	for (size_t k = 0; k < p->length; k++)
+		workerFree(&p->workers[k]);
+	for (size_t k = 0; k < p->jobs_length; k++)
+		jobFree(p->jobs[k]);
+	(void)sem_destroy(&p->work);
+	free(p->jobs);
+	free(p->workers);
+	free(p);
+	return r;
+}
+
+static int poolCreate(pickle_t *i, pickle_mod_t *m, long n) {
+	assert(m);
+	if (n < 1 || n > THREAD_MAX)
+		return error(i, "Invalid number of threads %ld", n);
+	pool_t *p = calloc(1, sizeof *p);
+	if (!p)
+		return error(i, "Out Of Memory");
+	if (sem_init(&p->work, 0, 0) < 0) {
+		free(p);
+		return error(i, "Could not create thread pool");
+	}
+	snprintf(p->name, sizeof p->name, "pool%p", (void*)p);
+	if (!(p->workers = calloc(n, sizeof *p->workers))) {
+		(void)poolFree(p);
+		return error(i, "Out Of Memory");
+	}
+	p->length = n;
+	heap_t *h = pickle_mod_heap(i);
+	for (long k = 0; k < n; k++) {
+		if (workerInit(p, &p->workers[k], k, h && h->slab.on) != PICKLE_OK) {
+			(void)poolFree(p);
+			return error(i, "Could not create thread pool");
+		}
+	}
+	if (pickle_mod_tag_add(m, p->name, p) != PICKLE_OK) {
+		(void)poolFree(p);
+		return error(i, "Out Of Memory");
+	}
+	return ok(i, "%s", p->name);
+}
+
+static int poolSend(pickle_t *i, pool_t *p, const char *script) {
+	assert(p);
+	assert(script);
+	if (p->jobs_length >= p->jobs_size) {
+		const size_t size = p->jobs_size ? p->jobs_size * 2 : 64;
+		job_t **jobs = realloc(p->jobs, size * sizeof *jobs);
+		if (!jobs)
+			return error(i, "Out Of Memory");
+		p->jobs = jobs;
+		p->jobs_size = size;
+	}
+	job_t *j = calloc(1, sizeof *j);
+	if (!j)
+		return error(i, "Out Of Memory");
+	if (sem_init(&j->done, 0, 0) < 0) {
+		free(j);
+		return error(i, "Could not create job");
+	}
+	if (!(j->script = duplicate(script))) {
+		jobFree(j);
+		return error(i, "Out Of Memory");
+	}
+	j->id = ++p->ids;
+	for (size_t k = 0;; k++) {
+		if (k && !(k % p->length)) { /* every queue is full, back off until the workers catch up */
+			const struct timespec ts = { .tv_sec = 0, .tv_nsec = 100000l };
+			(void)nanosleep(&ts, NULL);
+		}
+		if (queuePush(&p->workers[(p->next + k) % p->length].queue, j) == PICKLE_OK) {
+			p->next = (p->next + k + 1) % p->length;
+			break;
+		}
+	}
+	p->jobs[p->jobs_length++] = j;
+	(void)sem_post(&p->work);
+	return ok(i, "%lu", j->id);
+}
+
+static int poolWait(pickle_t *i, pool_t *p, const char *future) {
+	assert(p);
+	unsigned long id = 0;
+	if (future && sscanf(future, "%lu", &id) != 1)
+		return error(i, "Invalid future %s", future);
+	int r = PICKLE_OK;
+	for (size_t k = 0; k < p->jobs_length;) {
+		job_t *j = p->jobs[k];
+		if (future && j->id != id) {
+			k++;
+			continue;
+		}
+		while (sem_wait(&j->done) < 0)
+			;
+		if (future)
+			r = j->status == PICKLE_ERROR ? error(i, "%s", j->result ? j->result : "Out Of Memory") : ok(i, "%s", j->result);
+		else if (j->status == PICKLE_ERROR && r == PICKLE_OK) /* report the first error */
+			r = error(i, "%s", j->result ? j->result : "Out Of Memory");
+		p->jobs[k] = p->jobs[--p->jobs_length];
+		jobFree(j);
+		if (future)
+			return r;
+	}
+	if (future)
+		return error(i, "Invalid future %s", future);
+	return r == PICKLE_OK ? ok(i, "") : r;
+}
+
+static pool_t *pool(pickle_mod_t *m, const char *name) {
+	assert(m);
+	assert(name);
+	return strncmp(name, "pool", 4) ? NULL : pickle_mod_tag_find(m, name);
+}
+
+static int pickleCommandThread(pickle_t *i, int argc, char **argv, void *pd) {
+	pickle_mod_t *m = pd;
+	if (argc < 2)
+		return error(i, "Invalid command %s: expected create|send|wait|delete", argv[0]);
+	if (!strcmp(argv[1], "create")) {
+		long n = 4;
+		if (argc > 3 || (argc == 3 && sscanf(argv[2], "%ld", &n) != 1))
+			return error(i, "Invalid subcommand %s: expected ?threads?", argv[1]);
+		return poolCreate(i, m, n);
+	}
+	pool_t *p = argc > 2 ? pool(m, argv[2]) : NULL;
+	if (!p)
+		return error(i, "Invalid subcommand %s: expected pool", argv[1]);
+	if (!strcmp(argv[1], "send")) {
+		if (argc != 4)
+			return error(i, "Invalid subcommand %s: expected pool script", argv[1]);
+		return poolSend(i, p, argv[3]);
+	}
+	if (!strcmp(argv[1], "wait")) {
+		if (argc != 3 && argc != 4)
+			return error(i, "Invalid subcommand %s: expected pool ?future?", argv[1]);
+		return poolWait(i, p, argc == 4 ? argv[3] : NULL);
+	}
+	if (!strcmp(argv[1], "delete")) {
+		if (argc != 3)
+			return error(i, "Invalid subcommand %s: expected pool", argv[1]);
+		return pickle_mod_tag_remove(m, argv[2]) == PICKLE_OK ? PICKLE_OK : error(i, "delete '%s' failed", argv[2]);
+	}
+	return error(i, "Invalid subcommand %s", argv[1]);
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	UNUSED(m);
+	return poolFree(tag);
+}
+
+#else
+
+static int pickleCommandThread(pickle_t *i, int argc, char **argv, void *pd) {
+	UNUSED(argc);
+	UNUSED(pd);
+	return error(i, "Invalid command %s: not implemented", argv[0]);
+}
+
+static int cleanup(pickle_mod_t *m, void *tag) {
+	UNUSED(m);
+	UNUSED(tag);
+	return PICKLE_OK;
+}
+
+#endif
+
+int pickleModThreadRegister(pickle_mod_t *m) {
+	assert(m);
+	pickle_command_t cmds[] = {
+		{ "thread",  pickleCommandThread,  m },
+	};
+	m->cleanup = cleanup;
+	return pickle_mod_commands_register(m, cmds, NELEMS(cmds));
+}
@@ -1,20 +1,176 @@
 #include "mod.h"
 #include "utf8.h"
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Check the code point starting at 's[j]' for overlong encodings,
+ * surrogates and values beyond U+10FFFF, returning its length in bytes or
+ * zero if it is invalid. */
+static size_t utf8_decode(const unsigned char *s, const size_t j, const size_t length) {
+	assert(s);
+	assert(j < length);
+	const unsigned char c = s[j];
+	if (c < 0x80)
+		return 1;
+	unsigned char lo = 0x80, hi = 0xBF;
+	size_t l = 0;
+	if (c >= 0xC2 && c <= 0xDF)      { l = 2; }
+	else if (c == 0xE0)              { l = 3; lo = 0xA0; }
+	else if (c == 0xED)              { l = 3; hi = 0x9F; }
+	else if (c >= 0xE1 && c <= 0xEF) { l = 3; }
+	else if (c == 0xF0)              { l = 4; lo = 0x90; }
+	else if (c == 0xF4)              { l = 4; hi = 0x8F; }
+	else if (c >= 0xF1 && c <= 0xF3) { l = 4; }
+	else
+		return 0;
+	if ((j + l) > length)
+		return 0;
+	if (s[j + 1] < lo || s[j + 1] > hi)
+		return 0;
+	for (size_t k = 2; k < l; k++)
+		if ((s[j + k] & 0xC0) != 0x80)
+			return 0;
+	return l;
+}
+
+/* Validate a string of UTF-8 and count the number of code points in it. Most
+ * strings are mostly ASCII so blocks of ASCII are skipped over a vector (or a
+ * word if SIMD instructions are not available) at a time, anything else is
+ * decoded a byte at a time checking for overlong encodings, surrogates and
+ * code points beyond U+10FFFF. Returns 0 on success, -1 on invalid input. */
+static int utf8_count(const char *str, const size_t length, size_t *count) {
+	assert(str);
+	assert(count);
+	const unsigned char *s = (const unsigned char*)str;
+	size_t j = 0, n = 0;
+	*count = 0;
+	while (j < length) {
+#if defined(__AVX2__)
+		for (; (j + 32) <= length; j += 32, n += 32)
+			if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)&s[j])))
+				break;
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+		for (; (j + 16) <= length; j += 16, n += 16)
+			if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)&s[j])))
+				break;
+#endif
+		for (; (j + 8) <= length; j += 8, n += 8) {
+			uint64_t w = 0;
+			memcpy(&w, &s[j], sizeof w);
+			if (w & UINT64_C(0x8080808080808080))
+				break;
+		}
+		/* decode until the end of the block that contained non-ASCII */
+		const size_t stop = MIN(j + 16, length);
+		while (j < stop) {
+			const size_t l = utf8_decode(s, j, length);
+			if (!l)
+				return -1;
+			j += l, n++;
+		}
+	}
+	*count = n;
+	return 0;
+}
+
+/* only valid for the lead byte of valid UTF-8 */
+static inline size_t utf8_width(const unsigned char c) {
+	return c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+}
+
+/* Find the byte offset of code point 'n', or the length of the string if
+ * it has fewer code points than that, validating the code points walked
+ * over and the one found. Runs of ASCII are skipped a word at a time. The
+ * cost is proportional to the offset and not the length of the string, an
+ * index near the start of a long string is cheap, but a loop over every
+ * index is still quadratic; 'utf8 foreach' visits each code point once. */
+static int utf8_offset(const char *str, size_t length, size_t n, size_t *offset) {
+	assert(str);
+	assert(offset);
+	const unsigned char *s = (const unsigned char*)str;
+	size_t j = 0, k = 0;
+	*offset = length;
+	while (j < length && k < n) {
+		for (; (j + 8) <= length && (k + 8) <= n; j += 8, k += 8) {
+			uint64_t w = 0;
+			memcpy(&w, &s[j], sizeof w);
+			if (w & UINT64_C(0x8080808080808080))
+				break;
+		}
+		if (k == n || j == length)
+			break;
+		const size_t l = utf8_decode(s, j, length);
+		if (!l)
+			return -1;
+		j += l, k++;
+	}
+	if (j < length && !utf8_decode(s, j, length))
+		return -1;
+	*offset = j;
+	return 0;
+}
+
+/* Evaluate 'body' with 'var' set to each code point of a string in turn,
+ * which is linear in the length of the string. */
+static int utf8_foreach(pickle_t *i, const char *var, const char *str, const char *body) {
+	assert(i);
+	assert(var);
+	assert(str);
+	assert(body);
+	const unsigned char *s = (const unsigned char*)str;
+	const size_t length = strlen(str);
+	int r = PICKLE_OK;
+	for (size_t j = 0; j < length;) {
+		char c[5] = { 0 };
+		const size_t l = utf8_decode(s, j, length);
+		if (!l)
+			return error(i, "Invalid UTF-8 %s", str);
+		memcpy(c, &s[j], l);
+		j += l;
+		if ((r = pickle_var_set(i, var, c)) != PICKLE_OK)
+			return r;
+		r = pickle_eval(i, body);
+		if (r == PICKLE_BREAK)
+			break;
+		if (r != PICKLE_OK && r != PICKLE_CONTINUE)
+			return r;
+	}
+	return ok(i, "");
+}
+
+static int utf8_position(pickle_t *i, const char *s, unsigned long *n) {
+	assert(s);
+	assert(n);
+	if (!strcmp(s, "end")) {
+		*n = ULONG_MAX;
+		return 0;
+	}
+	if (sscanf(s, "%lu", n) != 1)
+		return error(i, "Invalid number %s", s);
+	return 0;
+}
 
 static int pickleCommandUtf8(pickle_t *i, int argc, char **argv, void *pd) {
 	UNUSED(pd);
 	if (argc < 3)
-		return error(i, "Invalid command %s: utf8 {valid} options...", argv[0]);
+		return error(i, "Invalid command %s: utf8 {valid|codepoints|index|range|split|foreach|ordinal|char} options...", argv[0]);
 	if (!strcmp("valid", argv[1])) {
 		size_t count = 0;
-		const int r = utf8_code_points(argv[1], &count);
-		return ok(i, "%c", r < 0 ? "0" : "1");
+		const int r = utf8_count(argv[2], strlen(argv[2]), &count);
+		return ok(i, "%d", r < 0 ? 0 : 1);
 	}
 	if (!strcmp("codepoints", argv[1])) {
 		size_t count = 0;
-		const int r = utf8_code_points(argv[2], &count);
+		const int r = utf8_count(argv[2], strlen(argv[2]), &count);
 		if (r < 0)
 			return error(i, "Invalid UTF-8 %s", argv[2]);
 		return ok(i, "%lu", (unsigned long)count);
@@ -22,22 +178,65 @@ static int pickleCommandUtf8(pickle_t *i, int argc, char **argv, void *pd) {
 	if (!strcmp("index", argv[1])) {
 		if (argc != 4)
 			return error(i, "Invalid subcommand %s", argv[1]);
-		unsigned long n = 0, codepoint = 0;
+		unsigned long n = 0;
 		if (sscanf(argv[3], "%lu", &n) != 1)
 			return error(i, "Invalid number %s", argv[3]);
-		char *s = argv[2];
-		for (unsigned long j = 0; j < (n + 1) && *s; j++)
-			if (utf8_next(&s, &codepoint) < 0)
+		const size_t length = strlen(argv[2]);
+		size_t j = 0;
+		if (utf8_offset(argv[2], length, n, &j) < 0)
+			return error(i, "Invalid UTF-8 %s", argv[2]);
+		if (j >= length)
+			return ok(i, "");
+		return ok(i, "%.*s", (int)utf8_width(argv[2][j]), &argv[2][j]);
+	}
+	if (!strcmp("range", argv[1])) {
+		if (argc != 5)
+			return error(i, "Invalid subcommand %s: expected string first last", argv[1]);
+		unsigned long first = 0, last = 0;
+		if (utf8_position(i, argv[3], &first) < 0 || utf8_position(i, argv[4], &last) < 0)
+			return PICKLE_ERROR;
+		const size_t length = strlen(argv[2]);
+		size_t start = 0, end = 0;
+		if (first == ULONG_MAX) {
+			size_t points = 0;
+			if (utf8_count(argv[2], length, &points) < 0)
 				return error(i, "Invalid UTF-8 %s", argv[2]);
-		if (*s) {
-			char u[8] = { 0 };
-			s = u;
-			size_t l = sizeof u;
-			if (utf8_add(&s, &l, codepoint) < 0)
-				return error(i, "Invalid codepoint %lu", codepoint);
-			return ok(i, "%s", u);
+			first = points ? points - 1 : 0;
 		}
-		return ok(i, "");
+		if (utf8_offset(argv[2], length, first, &start) < 0)
+			return error(i, "Invalid UTF-8 %s", argv[2]);
+		if (last < first || start >= length)
+			return ok(i, "");
+		end = start;
+		for (unsigned long k = first; end < length && k <= last; k++) {
+			const size_t w = utf8_decode((const unsigned char*)argv[2], end, length);
+			if (!w)
+				return error(i, "Invalid UTF-8 %s", argv[2]);
+			end += w;
+		}
+		return ok(i, "%.*s", (int)(end - start), &argv[2][start]);
+	}
+	if (!strcmp("split", argv[1])) {
+		if (argc != 3)
+			return error(i, "Invalid subcommand %s: expected string", argv[1]);
+		const size_t length = strlen(argv[2]);
+		size_t points = 0;
+		if (utf8_count(argv[2], length, &points) < 0)
+			return error(i, "Invalid UTF-8 %s", argv[2]);
+		pickle_buffer_t b = { .i = i };
+		for (size_t j = 0; j < length;) {
+			const size_t w = utf8_width(argv[2][j]);
+			if (pickle_buffer_element(&b, &argv[2][j], w) != PICKLE_OK)
+				return error(i, "Out Of Memory");
+			j += w;
+		}
+		const int r = ok(i, "%s", b.buf ? b.buf : "");
+		return pickle_buffer_free(&b) == PICKLE_OK ? r : PICKLE_ERROR;
+	}
+	if (!strcmp("foreach", argv[1])) {
+		if (argc != 5)
+			return error(i, "Invalid subcommand %s: expected variable string body", argv[1]);
+		return utf8_foreach(i, argv[2], argv[3], argv[4]);
 	}
 	if (!strcmp("ordinal", argv[1])) {
 		unsigned long codepoint = 0;
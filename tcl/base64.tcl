@@ -0,0 +1,108 @@
+# Round trip tests for base64 and hex, run with 'make test-base64'.
+
+proc expect {name got want} {
+	if {ne $got $want} { return "$name: got '$got', expected '$want'" -1 }
+}
+
+proc fails {name args} {
+	if {eq 0 [catch $args r]} { return "$name: expected an error, got '$r'" -1 }
+}
+
+proc slurp {file} {
+	set f [open $file r]
+	set r [read $f]
+	close $f
+	return $r
+}
+
+# Every prefix of a string long enough for both the SIMD kernels and the
+# scalar code, so each length splits the work differently between them.
+# The multibyte characters make both alphabets' last two characters show
+# up in the encoding.
+
+set text "Man is distinguished, not only by his reason ¿÷ÿ but by this ~~~ singular passion ÿÿÿ¿¿¿"
+set s ""
+utf8 foreach ch $text {
+	set s "$s$ch"
+	expect "base64 of '$s'" [base64 decode [base64 encode $s]] $s
+	expect "base64 -url of '$s'" [base64 decode -url [base64 encode -url $s]] $s
+	expect "hex of '$s'" [hex decode [hex encode $s]] $s
+}
+
+set e [base64 encode $text]
+set u [base64 encode -url $text]
+expect "base64 standard" $e "TWFuIGlzIGRpc3Rpbmd1aXNoZWQsIG5vdCBvbmx5IGJ5IGhpcyByZWFzb24gwr/Dt8O/IGJ1dCBieSB0aGlzIH5+fiBzaW5ndWxhciBwYXNzaW9uIMO/w7/Dv8K/wr/Cvw=="
+expect "base64 url" $u "TWFuIGlzIGRpc3Rpbmd1aXNoZWQsIG5vdCBvbmx5IGJ5IGhpcyByZWFzb24gwr_Dt8O_IGJ1dCBieSB0aGlzIH5-fiBzaW5ndWxhciBwYXNzaW9uIMO_w7_Dv8K_wr_Cvw=="
+fails "url alphabet as standard" base64 decode $u
+fails "standard alphabet as url" base64 decode -url $e
+
+# Padding is optional, white space is skipped
+
+expect "unpadded 1" [base64 decode YQ] a
+expect "unpadded 2" [base64 decode YWI] ab
+expect "padded 1" [base64 decode YQ==] a
+expect "padded 2" [base64 decode YWI=] ab
+fails "a lone character" base64 decode Y
+expect "wrapped" [base64 decode {TWFuIGlzIGRp
+ c3Rpbmd1aXNo	ZWQsIG5vdCBvbmx5}] "Man is distinguished, not only"
+expect "hex spaced" [hex decode "4d616e206973206469737469 6e677569736865642c 206e6f74206f6e6c79"] "Man is distinguished, not only"
+expect "hex wrapped" [hex decode {4d616e2069732064697374696e677569
+7368 6564 2c20	6e6f74206f6e6c79}] "Man is distinguished, not only"
+expect "hex upper case" [hex decode 4D616E2069732064697374696E6775697368] "Man is distinguish"
+
+# Invalid characters, in the SIMD blocks and in the scalar tail
+
+fails "base64 invalid" base64 decode YW*j
+fails "base64 invalid in a block" base64 decode TWFuIGlzIGRpc3Rp*md1aXNoZWQsIG5vdCBvbmx5
+fails "base64 data after padding" base64 decode YQ==YQ==
+fails "hex invalid" hex decode 4g
+fails "hex odd" hex decode 414
+fails "hex invalid in a block" hex decode 4d616e2069732064697374696e67756g7368656420
+fails "hex invalid after a block" hex decode 4d616e2069732064697374696e677569736865zz
+fails "NUL bytes" hex decode 410042
+
+# Files are converted in 48KiB chunks, lines of 76 base64 characters and
+# 60 hex digits (plus their newlines) put groups of characters and pairs
+# of digits across the chunk boundaries.
+
+set line57 "The quick brown fox jumps over the lazy dog, 0123456789!?"
+set line30 "Pack my box with five dozen li"
+set data57 ""
+set data30 ""
+set b [open test.b64 w]
+set h [open test.hex w]
+for {set k 0} {< $k 1000} {incr k} {
+	puts $b [base64 encode $line57]
+	puts $h [hex encode $line30]
+	set data57 "$data57$line57"
+	set data30 "$data30$line30"
+}
+close $b
+close $h
+
+base64 decode -file test.b64 test.out
+expect "base64 -file decode" [slurp test.out] $data57
+hex decode -file test.hex test.out
+expect "hex -file decode" [slurp test.out] $data30
+
+set f [open test.in w]
+write $f $data57
+close $f
+base64 encode -file test.in test.b64
+base64 decode -file test.b64 test.out
+expect "base64 -file round trip" [slurp test.out] $data57
+hex encode -file test.in test.hex
+hex decode -file test.hex test.out
+expect "hex -file round trip" [slurp test.out] $data57
+
+set f [open test.hex w]
+write $f "[hex encode $data30]4"
+close $f
+fails "hex -file odd" hex decode -file test.hex test.out
+
+file delete test.b64
+file delete test.hex
+file delete test.in
+file delete test.out
+
+unset text s ch e u line57 line30 data57 data30 b h k f
@@ -0,0 +1,54 @@
+# Turn the output of 'tcl/bench.tcl' into CSV:
+#
+#	./pickle tcl/bench.tcl | awk -f tcl/bench.awk > bench.csv
+#
+# or compare two CSV files, flagging benchmarks whose median time has
+# grown by more than 'threshold' percent (default 10) over the baseline,
+# exiting with a non zero status if there are any:
+#
+#	awk -v mode=compare -f tcl/bench.awk baseline.csv bench.csv
+
+BEGIN {
+	FS = ",";
+	if (threshold == "")
+		threshold = 10;
+	if (mode != "compare")
+		print "name,iterations,min,median,p90,p99,max,ops,allocations,bytes";
+}
+
+mode != "compare" && /^bench / {
+	line = $0;
+	gsub(/[{}]/, "", line);
+	n = split(line, f, " ");
+	row = f[2];
+	for (j = 4; j <= n; j += 2)
+		row = row "," f[j];
+	print row;
+	next;
+}
+
+mode == "compare" && FNR == 1 { next; } # header
+
+mode == "compare" && FNR == NR {
+	base[$1] = $4;
+	next;
+}
+
+mode == "compare" {
+	if (!($1 in base)) {
+		printf "%-24s new         median %d\n", $1, $4;
+		next;
+	}
+	change = base[$1] ? (($4 - base[$1]) * 100.0) / base[$1] : 0;
+	status = change > threshold ? "REGRESSION" : "ok";
+	if (change > threshold)
+		regressions++;
+	printf "%-24s %-11s median %d -> %d (%+.1f%%)\n", $1, status, base[$1], $4, change;
+}
+
+END {
+	if (mode == "compare" && regressions) {
+		printf "%d regression(s) over %d%%\n", regressions, threshold;
+		exit 1;
+	}
+}
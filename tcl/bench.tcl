@@ -0,0 +1,125 @@
+# Benchmark suite, run with 'make bench'. Each result is printed as:
+#
+#	bench NAME {iterations N} {min ns} {median ns} ... {bytes N}
+#
+# which 'tcl/bench.awk' turns into CSV and compares against a baseline.
+# Set PICKLE_BENCH_URL to a URL on a local server to include 'httpc'.
+
+proc emit {name result} {
+	puts "bench $name $result"
+}
+
+set allocator [getenv PICKLE_ALLOCATOR]
+if {eq "" $allocator} { set allocator system }
+
+# cdb: building, and looking up keys that exist, keys that do not and
+# keys with duplicate records.
+
+set dbf bench.cdb
+set klen 1000
+
+emit cdb-build [benchmark -iterations 10 -warmup 1 {
+	set c [cdb open $dbf w]
+	for {set k 0} {< $k $klen} {incr k} {
+		cdb write $c $k $k
+	}
+	cdb write $c dup 1
+	cdb write $c dup 2
+	cdb write $c dup 3
+	cdb close $c
+}]
+
+set c [cdb open $dbf r]
+emit cdb-hit       [benchmark -iterations 10000 {cdb exists $c 500}]
+emit cdb-miss      [benchmark -iterations 10000 {cdb exists $c missing}]
+emit cdb-read      [benchmark -iterations 10000 {cdb read $c 500}]
+emit cdb-dup-count [benchmark -iterations 10000 {cdb count $c dup}]
+emit cdb-dup-read  [benchmark -iterations 10000 {cdb read $c dup 2}]
+cdb close $c
+
+# expr: constants only, and with variables resolved from the interpreter
+
+set x 3
+set y 4
+emit expr-constant [benchmark -iterations 10000 {expr {1 + 2 * 3}}]
+emit expr-variable [benchmark -iterations 10000 {expr {x * x + y * y}}]
+emit expr-long     [benchmark -iterations 1000 {expr {(x + 1) * (y + 2) / (x + y) - (x * 3) + (y * 4) - 7 + pi}}]
+
+# utf8: validation and indexing of a long mixed ASCII and multibyte string
+
+set s "ascii text and éèê 中文 "
+for {set k 0} {< $k 10} {incr k} { set s "$s$s" }
+emit utf8-valid      [benchmark -iterations 1000 {utf8 valid $s}]
+emit utf8-codepoints [benchmark -iterations 1000 {utf8 codepoints $s}]
+emit utf8-index      [benchmark -iterations 1000 {utf8 index $s 10000}]
+emit utf8-range      [benchmark -iterations 1000 {utf8 range $s 5000 5100}]
+
+# visiting every character costs the same per character whatever the length
+# of the string, so 'utf8-foreach-2x' should take twice as long as
+# 'utf8-foreach' and no more
+
+set s2 "$s$s"
+emit utf8-foreach    [benchmark -iterations 10 {utf8 foreach ch $s {}}]
+emit utf8-foreach-2x [benchmark -iterations 10 {utf8 foreach ch $s2 {}}]
+
+# json: converting a whole document, and extracting one field from it
+
+set doc [json object name [json string "bench"] values [json array 1 2 3 4 5 6 7 8] nested [json object a [json array [json string x] [json string "y z"]] b true]]
+set doc [json array $doc $doc $doc $doc $doc $doc $doc $doc]
+emit json-parse [benchmark -iterations 1000 {json parse $doc}]
+emit json-get   [benchmark -iterations 1000 {json get $doc 7 nested a 1}]
+
+# base64 and hex: encoding and decoding 1MiB, divide by the median for
+# the throughput
+
+set big "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+/"
+for {set k 0} {< $k 14} {incr k} { set big "$big$big" }
+set big64 [base64 encode $big]
+set bighex [hex encode $big]
+emit base64-encode-1m [benchmark -iterations 50 {base64 encode $big}]
+emit base64-decode-1m [benchmark -iterations 50 {base64 decode $big64}]
+emit hex-encode-1m    [benchmark -iterations 50 {hex encode $big}]
+emit hex-decode-1m    [benchmark -iterations 50 {hex decode $bighex}]
+
+# pickle_slurp and source: reading a script file whole and line by line
+
+set script bench-source.tcl
+set f [open $script w]
+for {set k 0} {< $k 2000} {incr k} {
+	puts $f "set sourced $k"
+}
+close $f
+
+emit source-cached   [benchmark -iterations 100 {source $script}]
+emit source-nocache  [benchmark -iterations 100 {source -nocache $script}]
+emit slurp-read      [benchmark -iterations 100 {
+	set f [open $script]
+	read $f
+	close $f
+}]
+emit slurp-gets      [benchmark -iterations 100 {
+	set f [open $script]
+	while {1} { gets $f }
+	close $f
+}]
+
+# allocator churn: many short lived strings of varying size
+
+emit "alloc-churn-$allocator" [benchmark -iterations 100 {
+	for {set k 0} {< $k 200} {incr k} {
+		set junk "$k$k$k$k$k$k$k$k$k$k$s"
+	}
+}]
+
+# httpc: only against a server given in the environment, external hosts
+# would make results meaningless.
+
+set url [getenv PICKLE_BENCH_URL]
+if {ne "" $url} {
+	emit httpc-get  [benchmark -iterations 50 -warmup 2 {httpc get $url bench-http.out}]
+	emit httpc-head [benchmark -iterations 50 -warmup 2 {httpc head $url}]
+	file delete bench-http.out
+}
+
+file delete $dbf $script
+unset allocator dbf klen c x y s s2 ch doc big big64 bighex script f url sourced junk k
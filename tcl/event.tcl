@@ -0,0 +1,40 @@
+# Tests for the event loop, run with 'make test-event'. PICKLE_TEST_FIFO
+# names a FIFO to use as a channel that can be waited on, as regular files
+# cannot be.
+
+set fifo [getenv PICKLE_TEST_FIFO]
+if {eq "" $fifo} {
+	return "PICKLE_TEST_FIFO not set" -1
+}
+
+# Timers run in order of when they are due, idle scripts when nothing else
+# is ready.
+
+set order {}
+after 20 {set order "$order late"; set done 1}
+after 10 {set order "$order early"}
+after idle {set order "$order idle"}
+vwait done
+if {ne " idle early late" $order} {
+	return "timers ran out of order: $order" -1
+}
+
+# A handler left on a channel when it is closed must go with it, the next
+# channel opened gets the same file descriptor and must start with none.
+
+set f [open $fifo r+]
+fileevent $f writable {set got old}
+close $f
+set f [open $fifo r+]
+if {ne "" [fileevent $f writable]} {
+	return "handler of a closed channel kept: [fileevent $f writable]" -1
+}
+fileevent $f writable {set got new}
+vwait got
+if {ne new $got} {
+	return "handler of a closed channel ran: $got" -1
+}
+fileevent $f writable {}
+close $f
+
+unset fifo order done f got
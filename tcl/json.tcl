@@ -0,0 +1,113 @@
+# Tests for the json module, run with 'make test-json'.
+
+proc expect {name got want} {
+	if {ne $got $want} { return "$name: got '$got', expected '$want'" -1 }
+}
+
+proc fails {name want script} {
+	if {eq 0 [catch $script r]} { return "$name: expected an error, got '$r'" -1 }
+	expect $name $r $want
+}
+
+# Conversion to lists, empty objects and arrays nest as empty elements
+
+expect "object" [json parse {{"a": [1, "b c"], "e": {}, "f": [], "g": [{}, [[]]]}}] {a {1 {b c}} e {} f {} g {{} {{}}}}
+expect "empty array" [json parse {[]}] ""
+expect "empty object" [json parse {{}}] ""
+expect "empties" [json parse {[[], {}, ""]}] "{} {} {}"
+expect "literals" [json parse { [ 1 , -0.5e+3 , true , false , null ] }] "1 -0.5e+3 true false null"
+expect "quoting" [json parse {["{a}", "a b", "\\"]}] {{{a}} {a b} \\}
+expect "unbalanced" [json parse {"a{b"}] "a{b"
+expect "unicode escapes" [json parse {"\u00e9\ud83d\ude00"}] "é😀"
+
+# Round trips through the encoders
+
+set s {tab	here "q" \ / {x} é}
+expect "string" [json string $s] {"tab\there \"q\" \\ / {x} é"}
+expect "string round trip" [json parse [json string $s]] $s
+expect "array round trip" [json parse [json array 1 [json string "a b"] [json object k [json array]]]] "1 {a b} {k {}}"
+expect "object" [json object a 1 "b c" {{}}] {{"a":1,"b c":{}}}
+fails "array of text" {json: invalid value at offset 0 in value 'x'} {json array 1 x}
+fails "object of text" {json: trailing characters at offset 2 in value '1 2'} {json object a {1 2}}
+
+# Paths
+
+set doc {{"k": {"n": [10, 20, {"z": "deep"}]}}}
+expect "get index" [json get $doc k n 1] 20
+expect "get nested" [json get $doc k n 2 z] deep
+expect "get json" [json get -json $doc k n] {[10, 20, {"z": "deep"}]}
+expect "get json round trip" [json parse [json get -json $doc k n]] [json get $doc k n]
+expect "get all" [json get $doc] "k {n {10 20 {z deep}}}"
+fails "missing key" {json: path not found at offset 35} {json get {{"k": {"n": [10, 20, {"z": "deep"}]}}} k m}
+fails "missing index" {json: path not found at offset 34} {json get {{"k": {"n": [10, 20, {"z": "deep"}]}}} k n 3}
+fails "key into array" {json: path not found at offset 12} {json get {{"k": {"n": [10, 20, {"z": "deep"}]}}} k n x}
+fails "index into number" {json: path not found at offset 13} {json get {{"k": {"n": [10, 20, {"z": "deep"}]}}} k n 0 q}
+
+# Invalid input, with the offset of the problem
+
+fails "unterminated array" {json: expected ',' or ']' at offset 5} {json parse {[1, 2}}
+fails "trailing comma" {json: invalid value at offset 3} {json parse {[1,]}}
+fails "missing colon" {json: expected ':' at offset 5} {json parse {{"a" 1}}}
+fails "trailing comma in object" {json: expected string at offset 8} {json parse {{"a": 1,}}}
+fails "bad key" {json: expected string at offset 1} {json parse {{1: 2}}}
+fails "bad escape" {json: invalid escape at offset 3} {json parse {"\x"}}
+fails "lone surrogate" {json: invalid surrogate pair at offset 7} {json parse {"\ud800"}}
+fails "NUL" {json: NUL not representable at offset 8} {json parse {"a\u0000b"}}
+expect "NUL is valid JSON" [json valid {"a\u0000b"}] 1
+fails "leading zero" {json: trailing characters at offset 1} {json parse 01}
+fails "trailing text" {json: trailing characters at offset 4} {json parse {[1] x}}
+fails "bad literal" {json: invalid value at offset 0} {json parse tru}
+fails "empty" {json: unexpected end at offset 0} {json parse ""}
+expect "invalid" [json valid {[1,]}] 0
+
+# Nesting is limited to 128 levels
+
+set d {[]}
+for {set k 1} {< $k 128} {incr k} { set d "\[$d\]" }
+expect "deepest" [json valid $d] 1
+fails "too deep" {json: nested too deeply at offset 128} "json parse {\[$d\]}"
+
+# Newline delimited JSON is read in 64KiB chunks, the rows here and a
+# line longer than a chunk cross the chunk boundaries.
+
+set long x
+for {set k 0} {< $k 17} {incr k} { set long "$long$long" }
+set f [open test.json w]
+for {set k 0} {< $k 2000} {incr k} {
+	puts $f [json object id $k s [json string "row $k with some text to pad it out"]]
+	if {== $k 1000} {
+		puts $f ""
+		puts $f [json object id 0 s [json string $long]]
+	}
+}
+write $f {{"id": 2000, "s": "no newline"}}
+close $f
+
+set n 0
+set sum 0
+set gotlong 0
+json lines test.json row {
+	incr n
+	set sum [+ $sum [lindex $row 1]]
+	if {eq [lindex $row 3] $long} { set gotlong 1 }
+}
+expect "rows" $n 2002
+expect "sum of ids" $sum 2001000
+expect "long line" $gotlong 1
+
+set n 0
+json lines test.json row {
+	incr n
+	if {== $n 10} { break }
+}
+expect "break" $n 10
+
+set f [open test.json w]
+puts $f {{}}
+puts $f {{"a":}}
+close $f
+fails "bad line" {json: invalid value on line 2} {json lines test.json row {}}
+
+file delete test.json
+
+unset s doc d k long f n sum gotlong row
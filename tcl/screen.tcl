@@ -0,0 +1,77 @@
+# Tests for the bytes 'screen flush' writes, run with 'make test-screen'.
+
+proc expect {name got want} {
+	if {ne $got $want} { return "$name: got '$got', expected '$want'" -1 }
+}
+
+proc fails {name want script} {
+	if {eq 0 [catch $script r]} { return "$name: expected an error, got '$r'" -1 }
+	expect $name $r $want
+}
+
+# Flush the screen to a file and return what was written
+
+proc frame {} {
+	set f [open test.screen w]
+	screen flush $f
+	close $f
+	set f [open test.screen r]
+	set r [read $f]
+	close $f
+	return $r
+}
+
+screen size 10 3
+expect "size" [screen size] "10 3"
+
+# The first flush draws every cell, rows start with an absolute move
+
+screen put 0 0 hi "1;31"
+expect "full redraw" [frame] "\x1b\[1H\x1b\[0;1;31mhi\x1b\[0m        \x1b\[2H          \x1b\[3H          "
+expect "nothing changed" [frame] ""
+
+# After that only the cells that changed are sent, the attributes are
+# set once as the terminal's are not known at the start of a flush
+
+screen put 5 1 x
+expect "one cell" [frame] "\x1b\[2;6H\x1b\[0mx"
+
+# Writing a short gap of unchanged cells again is cheaper than moving
+# over it, a longer one is moved over
+
+screen put 2 2 a
+screen put 5 2 b
+expect "short gap" [frame] "\x1b\[3;3H\x1b\[0ma  b"
+screen put 1 2 c
+screen put 7 2 d
+expect "long gap" [frame] "\x1b\[3;2H\x1b\[0mc\x1b\[5Cd"
+
+# Terminals differ on where the cursor is after the last column, so the
+# next cell is found with an absolute move
+
+screen put 9 0 y
+screen put 0 1 w
+expect "end of row" [frame] "\x1b\[1;10H\x1b\[0my\x1b\[2Hw"
+
+# Only the colors are changed if the other attributes are the same, and
+# the attributes are reset at the end
+
+screen put 2 0 ab "1;31"
+screen put 4 0 c "1;32"
+screen put 5 0 d "38;5;208;48;5;17"
+expect "colors" [frame] "\x1b\[1;3H\x1b\[0;1;31mab\x1b\[32mc\x1b\[0;38;5;208;48;5;17md\x1b\[0m"
+
+fails "unknown attribute" "Invalid attributes bogus" {screen put 0 0 x bogus}
+fails "unknown SGR parameter" "Invalid attributes 99" {screen put 0 0 x 99}
+fails "color out of range" "Invalid attributes 38;5;256" {screen put 0 0 x "38;5;256"}
+fails "color missing" "Invalid attributes 38;5" {screen put 0 0 x "38;5"}
+fails "trailing text" "Invalid attributes 1;x" {screen put 0 0 x "1;x"}
+fails "bad size" "Invalid size 0 3" {screen size 0 3}
+
+# 'invalidate' draws everything again, here a cleared screen
+
+screen clear "1;"
+screen invalidate
+expect "invalidated" [frame] "\x1b\[1H\x1b\[0m          \x1b\[2H          \x1b\[3H          "
+
+file delete test.screen
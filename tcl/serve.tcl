@@ -0,0 +1,7 @@
+# Run on a server by 'make test-serve', from a directory holding 'cwd.txt'
+# to check the client's working directory is used.
+
+set f [open cwd.txt]
+puts "cwd [read $f]"
+close $f
+exit 7
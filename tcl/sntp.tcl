@@ -0,0 +1,85 @@
+# Tests for 'sntp -servers' against the loopback responder 'tcl/sntpd.py',
+# run with 'make test-sntp'. The responder answers on 127.0.0.1 after 100ms
+# with an offset of two seconds, then sends a second reply of 100 seconds,
+# on 127.0.0.2 at once with 2.001 seconds, on 127.0.0.3 with 500 seconds
+# and not at all on 127.0.0.4.
+
+set port [getenv PICKLE_TEST_SNTP_PORT]
+if {eq "" $port} {
+	return "PICKLE_TEST_SNTP_PORT not set" -1
+}
+
+proc within {name value lo hi} {
+	if {< $value $lo} { return "$name is $value, less than $lo" -1 }
+	if {> $value $hi} { return "$name is $value, more than $hi" -1 }
+}
+
+proc field {result n} {
+	return [lindex [lindex $result $n] 1]
+}
+
+proc elapsed {start} {
+	return [- [clock monotonic -ms] $start]
+}
+
+# a server that never answers times out
+
+set start [clock monotonic -ms]
+if {eq 0 [catch {sntp -servers 127.0.0.4 -port $port -timeout 200} r]} {
+	return "a silent server answered: $r" -1
+}
+within "time to give up (ms)" [elapsed $start] 200 1000
+
+# the first reply from a server is used, later ones are ignored
+
+set r [sntp -servers 127.0.0.1 -port $port -timeout 1000 -refresh 3600]
+within "offset of the first reply (ms)" [/ [field $r 0] 1000000] 1990 2010
+within "servers used" [field $r 2] 1 1
+
+# replies from all servers are waited for until the timeout, the
+# falseticker is dropped and the median of the rest kept
+
+set start [clock monotonic -ms]
+set r [sntp -servers {127.0.0.1 127.0.0.2 127.0.0.3 127.0.0.4} -port $port -timeout 300 -refresh 3600]
+within "time to wait for all servers (ms)" [elapsed $start] 300 1000
+within "servers used" [field $r 2] 2 2
+within "median offset (ms)" [/ [field $r 0] 1000000] 1990 2010
+
+# 'sntp now' answers from the cached offset, without waiting on 127.0.0.1
+
+set start [clock monotonic -ms]
+set now [sntp now]
+within "time for a cached 'sntp now' (ms)" [elapsed $start] 0 50
+within "cached offset (s)" [- [lindex $now 0] [clock seconds]] 1 3
+
+# once the refresh interval has passed 'sntp now' queries again
+
+sntp -servers 127.0.0.1 -port $port -timeout 1000 -refresh 0
+set start [clock monotonic -ms]
+set now [sntp now]
+within "time for a refreshing 'sntp now' (ms)" [elapsed $start] 90 1000
+within "refreshed offset (s)" [- [lindex $now 0] [clock seconds]] 1 3
+
+# '-command' returns at once and calls the script with the result from
+# the event loop, so queries to different servers are in flight together:
+# each one finishes at its own time rather than after the ones before it
+
+set start [clock monotonic -ms]
+sntp -servers 127.0.0.1 -port $port -timeout 1000 -command {set first}
+sntp -servers {127.0.0.3 127.0.0.4} -port $port -timeout 300 -command {set second}
+sntp -servers 127.0.0.4 -port $port -timeout 200 -command {set third}
+within "time to start three queries (ms)" [elapsed $start] 0 50
+vwait first
+within "time to the first reply (ms)" [elapsed $start] 90 190
+within "offset of the first reply (ms)" [/ [field $first 0] 1000000] 1990 2010
+vwait third
+within "time to the silent server's timeout (ms)" [elapsed $start] 200 290
+within "servers that answered" [field $third 0] 0 0
+vwait second
+within "time to the last timeout (ms)" [elapsed $start] 300 390
+within "servers used" [field $second 2] 1 1
+
+rename within {}
+rename field {}
+rename elapsed {}
+unset port start r now first second third
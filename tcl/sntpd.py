@@ -0,0 +1,34 @@
+# Loopback SNTP responder for 'tcl/sntp.tcl', run by 'make test-sntp':
+#
+#	python3 tcl/sntpd.py PORT
+#
+# Each address on the loopback network behaves differently, see the test.
+import socket, struct, sys, threading, time
+
+def stamp(t):
+	return struct.pack('>II', int(t) + 2208988800, int((t % 1) * 2**32))
+
+def reply(request, received, offset):
+	sent = time.time() + offset
+	return bytes([0x24, 1, 0, 0]) + bytes(20) + request[40:48] + stamp(received + offset) + stamp(sent)
+
+def serve(address, port, offsets, delay):
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.bind((address, port))
+	while True:
+		request, client = s.recvfrom(48)
+		received = time.time()
+		time.sleep(delay)
+		for offset in offsets:
+			s.sendto(reply(request, received, offset), client)
+
+port = int(sys.argv[1])
+servers = [
+	('127.0.0.1', [2.0, 100.0], 0.1), # slow, and a second reply that must be ignored
+	('127.0.0.2', [2.001], 0.0),
+	('127.0.0.3', [500.0], 0.0),      # a falseticker
+	('127.0.0.4', [], 0.0),           # never answers
+]
+for address, offsets, delay in servers:
+	threading.Thread(target=serve, args=(address, port, offsets, delay), daemon=True).start()
+threading.Event().wait()
@@ -0,0 +1,56 @@
+# Tests for thread pools, run with 'make test-thread'.
+
+proc expect {name got want} {
+	if {ne $got $want} { return "$name: got '$got', expected '$want'" -1 }
+}
+
+proc fails {name want script} {
+	if {eq 0 [catch $script r]} { return "$name: expected an error, got '$r'" -1 }
+	expect $name $r $want
+}
+
+# More jobs than fit in every worker's queue, so sending has to wait for
+# the workers to catch up, and each job's result must come back to the
+# future it was sent with.
+
+set jobs 6000
+set p [thread create 4]
+for {set k 0} {< $k $jobs} {incr k} {
+	set f$k [thread send $p "+ $k $k"]
+}
+for {set k 0} {< $k $jobs} {incr k} {
+	expect "job $k" [thread wait $p [set f$k]] [+ $k $k]
+}
+fails "future already waited on" "Invalid future [set f0]" "thread wait $p [set f0]"
+
+# Errors are returned by the future that failed, waiting on everything
+# reports the first of them
+
+set good [thread send $p "+ 1 1"]
+set bad [thread send $p {return "job failed" -1}]
+fails "error result" "job failed" "thread wait $p $bad"
+expect "result after an error" [thread wait $p $good] 2
+for {set k 0} {< $k 100} {incr k} {
+	thread send $p "+ $k 1"
+}
+thread send $p {return "first" -1}
+fails "wait for all" first "thread wait $p"
+expect "nothing left" [thread wait $p] ""
+fails "bad future" "Invalid future x" "thread wait $p x"
+thread delete $p
+
+# Deleting a pool with work still queued finishes the work first
+
+set p [thread create 2]
+for {set k 0} {< $k 200} {incr k} {
+	thread send $p {for {set j 0} {< $j 1000} {incr j} {}}
+}
+thread delete $p
+fails "deleted pool" "Invalid subcommand send: expected pool" "thread send $p {+ 1 1}"
+
+fails "no threads" "Invalid number of threads 0" {thread create 0}
+
+for {set k 0} {< $k $jobs} {incr k} {
+	unset f$k
+}
+unset jobs p k good bad